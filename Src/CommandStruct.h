@@ -19,13 +19,29 @@ struct ParamStruct {
 	ParamType Type;
 };
 
+// Shaders can read from up to 16 samplers.
+const int MaxSamplers = 16;
+
+// One row of the command chain. Param and ClipIndex point to arrays owned by the Shader filter.
 struct CommandStruct {
-	byte CommandIndex;
+	int CommandIndex;
 	const char* Path;
 	const char* EntryPoint;
 	const char* ShaderModel;
-	ParamStruct Param[9];
-	byte ClipIndex[9];
-	byte OutputIndex;
+	int ParamCount;
+	ParamStruct* Param;		// Parameters of registers c0 onwards.
+	int ClipCount;
+	const int* ClipIndex;	// Clips of samplers s0 onwards, or 0 for unused samplers.
+	int OutputIndex;
 	int OutputWidth, OutputHeight;
 };
+
+// Returns the clip index of a sampler, or 0 if it isn't set.
+inline int GetClipIndex(const CommandStruct* cmd, int sampler) {
+	return sampler < cmd->ClipCount ? cmd->ClipIndex[sampler] : 0;
+}
+
+// Returns whether a command runs a shader. Other commands copy Clip1 to Output.
+inline bool HasShader(const CommandStruct* cmd) {
+	return cmd->Path != NULL && cmd->Path[0] != '\0';
+}
@@ -1,40 +1,110 @@
 #include "ConvertFromShader.h"
 
-ConvertFromShader::ConvertFromShader(PClip _child, int _precision, const char* _format, bool _stack16, IScriptEnvironment* env) :
-	GenericVideoFilter(_child), precision(_precision), format(_format), stack16(_stack16) {
+ConvertFromShader::ConvertFromShader(PClip _child, int _precision, const char* _format, bool _stack16, const char* _chromaPlacement, int _dither, int _threads, int _opt, bool _luma, IScriptEnvironment* env) :
+	GenericVideoFilter(_child), precision(_precision == 4 ? 2 : _precision), packed10(_precision == 4), format(_format), stack16(_stack16), dither(_dither), threads(_threads), luma(_luma) {
 	if (!vi.IsRGB32())
 		env->ThrowError("ConvertFromShader: Source must be float-precision RGB");
-	if (strcmp(format, "YV12") != 0 && strcmp(format, "YV24") != 0 && strcmp(format, "RGB24") != 0 && strcmp(format, "RGB32") != 0)
-		env->ThrowError("ConvertFromShader: Destination format must be YV12, YV24, RGB24 or RGB32");
-	if (precision < 1 || precision > 3)
-		env->ThrowError("ConvertFromShader: Precision must be 1, 2 or 3");
-	if (stack16 && strcmp(format, "YV12") != 0 && strcmp(format, "YV24") != 0)
-		env->ThrowError("Conversion to Stack16 only supports YV12 and YV24");
+	if (_precision < 1 || _precision > 4)
+		env->ThrowError("ConvertFromShader: Precision must be 1, 2, 3 or 4");
+	if (packed10 && luma)
+		env->ThrowError("ConvertFromShader: Precision=4 can't be used with Luma");
+	if (stack16 && strcmp(format, "YV12") != 0 && strcmp(format, "YV24") != 0 && strcmp(format, "Y8") != 0)
+		env->ThrowError("Conversion to Stack16 only supports YV12, YV24 and Y8");
+	if (luma != (strcmp(format, "Y8") == 0 || strcmp(format, "Y16") == 0))
+		env->ThrowError("ConvertFromShader: Y8 and Y16 formats are only used with Luma, which requires one of them");
+	if (strcmp(_chromaPlacement, "MPEG2") != 0 && strcmp(_chromaPlacement, "MPEG1") != 0)
+		env->ThrowError("ConvertFromShader: ChromaOutPlacement must be MPEG1 or MPEG2");
+	if (dither < 0 || dither > 2)
+		env->ThrowError("ConvertFromShader: Dither must be 0, 1 or 2");
+	if (threads < 0)
+		env->ThrowError("ConvertFromShader: Threads must be 0 or higher");
+	if (_opt < -1 || _opt > CPU_LEVEL_AVX512)
+		env->ThrowError("ConvertFromShader: Opt must be between -1 and 4");
 
 	viDst = vi;
 	if (strcmp(format, "RGB32") == 0)
 		viDst.pixel_type = VideoInfo::CS_BGR32;
 	else if (strcmp(format, "RGB24") == 0)
 		viDst.pixel_type = VideoInfo::CS_BGR24;
-	else
+	else if (strcmp(format, "YV12") == 0)
+		viDst.pixel_type = VideoInfo::CS_YV12;
+	else if (strcmp(format, "YV24") == 0)
 		viDst.pixel_type = VideoInfo::CS_YV24;
+	else if (strcmp(format, "YUV420P10") == 0)
+		viDst.pixel_type = VideoInfo::CS_YUV420P10;
+	else if (strcmp(format, "YUV420P16") == 0)
+		viDst.pixel_type = VideoInfo::CS_YUV420P16;
+	else if (strcmp(format, "YUV444P10") == 0)
+		viDst.pixel_type = VideoInfo::CS_YUV444P10;
+	else if (strcmp(format, "YUV444P16") == 0)
+		viDst.pixel_type = VideoInfo::CS_YUV444P16;
+	else if (strcmp(format, "RGBP16") == 0)
+		viDst.pixel_type = VideoInfo::CS_RGBP16;
+	else if (strcmp(format, "YUV444PS") == 0)
+		viDst.pixel_type = VideoInfo::CS_YUV444PS;
+	else if (strcmp(format, "RGBPS") == 0)
+		viDst.pixel_type = VideoInfo::CS_RGBPS;
+	else if (strcmp(format, "NV12") == 0)
+		viDst.pixel_type = VideoInfo::CS_Y8;
+	else if (strcmp(format, "P010") == 0 || strcmp(format, "P016") == 0 || strcmp(format, "Y16") == 0)
+		viDst.pixel_type = VideoInfo::CS_Y16;
+	else if (strcmp(format, "Y8") == 0)
+		viDst.pixel_type = VideoInfo::CS_Y8;
+	else
+		env->ThrowError("ConvertFromShader: Destination format must be YV12, YV24, RGB24, RGB32, NV12, P010, P016, Y8, Y16, YUV420P10, YUV420P16, YUV444P10, YUV444P16, RGBP16, YUV444PS or RGBPS");
+
+	// High bit depth formats require AviSynth+. YV12 matches the generic 4:2:0 type.
+	// Semi-planar formats are stored in a Y8 or Y16 clip, with rows of interleaved U and V below the luma rows.
+	semiPlanar = strcmp(format, "NV12") == 0 || strcmp(format, "P010") == 0 || strcmp(format, "P016") == 0;
+	bitsPerComponent = strcmp(format, "P010") == 0 ? 10 : GetBitsPerComponent(viDst);
+	subsampledChroma = semiPlanar || (viDst.pixel_type & ~VideoInfo::CS_Sample_Bits_Mask) == VideoInfo::CS_GENERIC_YUV420;
+	planarRgb = (viDst.pixel_type & ~VideoInfo::CS_Sample_Bits_Mask) == VideoInfo::CS_GENERIC_RGBP;
 
 	if (stack16)		// Stack16 frame has twice the height
 		viDst.height <<= 1;
-	if (precision > 1)	// UINT16 frame has twice the width
+	if (semiPlanar)		// Chroma rows add half the height
+		viDst.height += viDst.height >> 1;
+	if (luma)			// Single-channel frame has 1 or 2 bytes per pixel
+		viDst.width = vi.width * 4 / (precision == 1 ? 1 : 2);
+	else if (precision > 1 && !packed10)	// UINT16 frame has twice the width
 		viDst.width >>= 1;
 
 	if (precision == 1)
 		precisionShift = 2;
-	else if (precision == 2)
-		precisionShift = 3;
 	else
-		precisionShift = 4;
+		precisionShift = 3;
 
-	if (precision == 3) {
-		floatBufferPitch = vi.width << 3;
-		halfFloatBufferPitch = vi.width << 2;
-	}
+	if (subsampledChroma && ((viDst.width & 1) || (vi.height & 1)))
+		env->ThrowError("ConvertFromShader: 4:2:0 output requires even width and height");
+	mpeg1Chroma = strcmp(_chromaPlacement, "MPEG1") == 0;
+
+	// Dithering only applies when 16-bit data is reduced to 8-bit
+	if (precision == 1 || stack16 || bitsPerComponent > 8)
+		dither = 0;
+
+	// Half-float data requires F16C and packing 32-bit integers requires SSE4.1. Both are only used from the AVX2 level,
+	// so that lower levels can be forced. RGB24 output requires SSSE3 to shuffle bytes. Otherwise the scalar code is used.
+	int cpuFlags = env->GetCPUFlags();
+	cpuLevel = GetCpuLevel(cpuFlags, _opt);
+	useSimd = cpuLevel >= CPU_LEVEL_SSE2;
+	if (precision == 3 && (cpuLevel < CPU_LEVEL_AVX2 || (cpuFlags & CPUF_F16C) == 0))
+		useSimd = false;
+	if (viDst.IsRGB24() && cpuLevel < CPU_LEVEL_SSSE3)
+		useSimd = false;
+
+	// Scalar row kernels, also used for the pixels left over by SIMD.
+	if (precision == 1)
+		convRowYuv = stack16 ? &ConvertFromShader::convRowToYV24<1, true> : &ConvertFromShader::convRowToYV24<1, false>;
+	else if (precision == 2)
+		convRowYuv = stack16 ? &ConvertFromShader::convRowToYV24<2, true> : &ConvertFromShader::convRowToYV24<2, false>;
+	else
+		convRowYuv = stack16 ? &ConvertFromShader::convRowToYV24<3, true> : &ConvertFromShader::convRowToYV24<3, false>;
+	if (precision == 1)
+		convRowRgb = viDst.IsRGB32() ? &ConvertFromShader::convRowToRGB<1, 4> : &ConvertFromShader::convRowToRGB<1, 3>;
+	else if (precision == 2)
+		convRowRgb = viDst.IsRGB32() ? &ConvertFromShader::convRowToRGB<2, 4> : &ConvertFromShader::convRowToRGB<2, 3>;
+	else
+		convRowRgb = viDst.IsRGB32() ? &ConvertFromShader::convRowToRGB<3, 4> : &ConvertFromShader::convRowToRGB<3, 3>;
 }
 
 ConvertFromShader::~ConvertFromShader() {
@@ -46,138 +116,951 @@ PVideoFrame __stdcall ConvertFromShader::GetFrame(int n, IScriptEnvironment* env
 
 	// Convert from float-precision RGB to YV24
 	PVideoFrame dst = env->NewVideoFrame(viDst);
-	if (viDst.IsRGB())
-		convFloatToRGB32(src->GetReadPtr(), dst->GetWritePtr(), src->GetPitch(), dst->GetPitch(), viDst.width, viDst.height, env);
+	const int planeY = planarRgb ? PLANAR_R : PLANAR_Y;
+	const int planeU = planarRgb ? PLANAR_G : PLANAR_U;
+	const int planeV = planarRgb ? PLANAR_B : PLANAR_V;
+	const byte* srcPtr = src->GetReadPtr();
+	int srcPitch = src->GetPitch();
+	if (packed10) {
+		// 10-bit pixels are first unpacked into UINT16, then converted like Precision=2.
+		// The whole frame is unpacked because 4:2:0 output reads pairs of rows across stripes.
+		static thread_local ScratchBuffer unpackBuffer;
+		const int bufferPitch = (vi.width * 8 + 63) & ~63;
+		uint16_t* words = unpackBuffer.Get<uint16_t>(bufferPitch / 2 * vi.height);
+		ThreadPool::GetInstance().Run(threads, vi.height, 1, [&](int yStart, int yEnd) {
+			for (int y = yStart; y < yEnd; ++y) {
+				unpackRow10(srcPtr + y * srcPitch, words + y * (bufferPitch / 2), vi.width);
+			}
+		});
+		srcPtr = (const byte*)words;
+		srcPitch = bufferPitch;
+	}
+	unsigned char* dstY = dst->GetWritePtr(planeY);
+	const int dstPitchY = dst->GetPitch(planeY);
+	unsigned char *dstU, *dstV;
+	int dstPitchUV, dstHeight;
+	if (semiPlanar) {
+		// Interleaved chroma rows follow the luma rows, each V sample right after its U sample.
+		dstU = dstY + vi.height * dstPitchY;
+		dstV = dstU + (bitsPerComponent > 8 ? 2 : 1);
+		dstPitchUV = dstPitchY;
+		dstHeight = vi.height;
+	}
+	else if (luma) {
+		dstU = dstV = NULL;
+		dstPitchUV = 0;
+		dstHeight = viDst.height;
+	}
+	else {
+		dstU = viDst.IsRGB() && !planarRgb ? NULL : dst->GetWritePtr(planeU);
+		dstV = viDst.IsRGB() && !planarRgb ? NULL : dst->GetWritePtr(planeV);
+		dstPitchUV = viDst.IsRGB() && !planarRgb ? 0 : dst->GetPitch(planeU);
+		dstHeight = viDst.height;
+	}
+
+	// Texture rows are split into stripes that are converted in parallel. 4:2:0 output needs pairs of rows
+	// and error diffusion carries errors from one row to the next, so it must run in a single stripe.
+	auto convRows = [&](int yStart, int yEnd) {
+		if (luma)
+			convFloatToLuma(srcPtr, dstY, srcPitch, dstPitchY, viDst.width, dstHeight, yStart, yEnd);
+		else if (bitsPerComponent == 32)
+			convFloatToPlanarFloat(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else if (bitsPerComponent > 8 && subsampledChroma)
+			convFloatTo420(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else if (bitsPerComponent > 8)
+			convFloatToPlanar16(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else if (viDst.IsRGB() && dither)
+			convFloatToRGB32_dither(srcPtr, dstY, srcPitch, dstPitchY, viDst.width, dstHeight, yStart, yEnd);
+		else if (viDst.IsYV24() && dither)
+			convFloatToYV24_dither(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else if (viDst.IsRGB() && useSimd)
+			convFloatToRGB32_simd(srcPtr, dstY, srcPitch, dstPitchY, viDst.width, dstHeight, yStart, yEnd);
+		else if (viDst.IsRGB())
+			convFloatToRGB32(srcPtr, dstY, srcPitch, dstPitchY, viDst.width, dstHeight, yStart, yEnd);
+		else if (subsampledChroma)
+			convFloatTo420(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else if (useSimd)
+			convFloatToYV24_simd(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+		else
+			convFloatToYV24(srcPtr, dstY, dstU, dstV, srcPitch, dstPitchY, dstPitchUV, viDst.width, dstHeight, yStart, yEnd);
+	};
+	if (dither == 2)
+		convRows(0, vi.height);
 	else
-		convFloatToYV24(src->GetReadPtr(),
-			dst->GetWritePtr(PLANAR_Y), dst->GetWritePtr(PLANAR_U), dst->GetWritePtr(PLANAR_V),
-			src->GetPitch(), dst->GetPitch(PLANAR_Y), dst->GetPitch(PLANAR_U), viDst.width, viDst.height, env);
+		ThreadPool::GetInstance().Run(threads, vi.height, subsampledChroma ? 2 : 1, convRows);
 	return dst;
 }
 
+// Unpacks one row of A2R10G10B10 pixels into the UINT16 texture layout, Y, U, V and alpha words.
+// 10-bit values are shifted left without filling the low bits, so that rounding back to 10-bit restores them.
+void ConvertFromShader::unpackRow10(const byte* src, uint16_t* dst, int width)
+{
+	const __m128i mask = _mm_set1_epi32(0x3FF);
+	const __m128i alphaScale = _mm_set1_epi32(0x5555);
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? width & ~3 : 0;
+	const uint32_t* srcD = (const uint32_t*)src;
+
+	for (int x = 0; x < widthMod; x += 4) {
+		const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcD + x));
+		const __m128i valY = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(px, 20), mask), 6);
+		const __m128i valU = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(px, 10), mask), 6);
+		const __m128i valV = _mm_slli_epi32(_mm_and_si128(px, mask), 6);
+		const __m128i valA = _mm_mullo_epi16(_mm_srli_epi32(px, 30), alphaScale);
+		const __m128i yu = _mm_or_si128(valY, _mm_slli_epi32(valU, 16));
+		const __m128i va = _mm_or_si128(valV, _mm_slli_epi32(valA, 16));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 2)), _mm_unpacklo_epi32(yu, va));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 2) + 8), _mm_unpackhi_epi32(yu, va));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		const uint32_t px = srcD[x];
+		uint16_t* out = dst + (x << 2);
+		out[0] = (px >> 20 & 0x3FF) << 6;
+		out[1] = (px >> 10 & 0x3FF) << 6;
+		out[2] = (px & 0x3FF) << 6;
+		out[3] = (px >> 30) * 0x5555;
+	}
+}
+
 void ConvertFromShader::convFloatToYV24(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
-	int pitch1, int pitch2Y, int pitch2UV, int width, int height, IScriptEnvironment* env)
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
+	if (stack16)
+		height >>= 1;
+
+	// Stack16 LSB planes are stored below the MSB planes
+	const int lsbOffsetY = pitch2Y * height;
+	const int lsbOffsetUV = pitch2UV * height;
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += yStart * pitch2UV;
+	pv += yStart * pitch2UV;
+	for (int y = yStart; y < yEnd; ++y) {
+		(this->*convRowYuv)(src, py, pu, pv, lsbOffsetY, lsbOffsetUV, 0, width);
+		src += pitch1;
+		py += pitch2Y;
+		pu += pitch2UV;
+		pv += pitch2UV;
+	}
+}
+
+// Stack16 isn't supported for RGB.
+void ConvertFromShader::convFloatToRGB32(const byte *src, unsigned char *dst,
+	int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd) {
+
+	src += yStart * pitchSrc;
+	dst += (height - yStart) * pitchDst;
+	for (int y = yStart; y < yEnd; ++y) {
+		dst -= pitchDst;
+		(this->*convRowRgb)(src, dst, 0, width);
+		src += pitchSrc;
+	}
+}
+
+// Converts pixels xStart to width of one row into YV24. Specialized for each precision and Stack16 so that the pixel loop has no branch.
+template <int Precision, bool Stack16>
+void ConvertFromShader::convRowToYV24(const byte* src, unsigned char* py, unsigned char* pu, unsigned char* pv, int lsbOffsetY, int lsbOffsetUV, int xStart, int width)
 {
-	unsigned char *floatBuffer;
-	unsigned char *halfFloatBuffer;
+	for (int x = xStart; x < width; ++x) {
+		if (Stack16)
+			convStack16<Precision>(src + x * (Precision == 1 ? 4 : 8), &py[x], &pu[x], &pv[x], &py[x + lsbOffsetY], &pu[x + lsbOffsetUV], &pv[x + lsbOffsetUV]);
+		else
+			convInt<Precision>(src + x * (Precision == 1 ? 4 : 8), &py[x], &pu[x], &pv[x]);
+	}
+}
 
-	if (precision == 3) {
-		floatBuffer = new unsigned char[floatBufferPitch]; // local 
-		halfFloatBuffer = new unsigned char[halfFloatBufferPitch];
+// Converts pixels xStart to width of one row into RGB24 or RGB32, specialized for each precision and pixel size.
+template <int Precision, int PixelSize>
+void ConvertFromShader::convRowToRGB(const byte* src, unsigned char* dst, int xStart, int width)
+{
+	unsigned char* Val;
+	for (int x = xStart; x < width; ++x) {
+		Val = dst + x * PixelSize;
+		convInt<Precision>(src + x * (Precision == 1 ? 4 : 8), &Val[2], &Val[1], &Val[0]);
+		if (PixelSize == 4)
+			Val[3] = 255;
 	}
+}
 
-	const byte* srcLoop = precision == 3 ? floatBuffer : src;
-	int srcLoopPitch = precision == 3 ? floatBufferPitch : pitch1;
+// Loads 8 pixels of texture data as 16-bit words in texture channel order, 2 pixels per register.
+// Precision 1 stays between 0 and 255, precision 2 and 3 are between 0 and 65535.
+static inline void load_8_i16(const byte* src, int precision, bool roundHalf, __m128i* w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	if (precision == 1) {
+		const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+		const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+		w[0] = _mm_unpacklo_epi8(lo, zero);
+		w[1] = _mm_unpackhi_epi8(lo, zero);
+		w[2] = _mm_unpacklo_epi8(hi, zero);
+		w[3] = _mm_unpackhi_epi8(hi, zero);
+	}
+	else if (precision == 2) {
+		for (int i = 0; i < 4; i++) {
+			w[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (i << 4)));
+		}
+	}
+	else {
+		// Colors are in the 0 to 1 range. Truncate like the scalar code unless the full 16 bits are kept.
+		const __m128 zeroF = _mm_setzero_ps();
+		const __m128 oneF = _mm_set1_ps(1.0f);
+		const __m128 scale = _mm_set1_ps(65535.0f);
+		__m128 lo, hi;
+		for (int i = 0; i < 4; i++) {
+			const __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (i << 4)));
+			lo = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_cvtph_ps(val), zeroF), oneF), scale);
+			hi = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_cvtph_ps(_mm_srli_si128(val, 8)), zeroF), oneF), scale);
+			if (roundHalf)
+				w[i] = _mm_packus_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+			else
+				w[i] = _mm_packus_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+		}
+	}
+}
 
+// Splits 8 pixels of 4-channel words into one register per channel. The 4th channel is dropped.
+static inline void deinterleave_8_i16(const __m128i* w, __m128i* c)
+{
+	const __m128i a0 = _mm_unpacklo_epi16(w[0], w[1]);
+	const __m128i a1 = _mm_unpackhi_epi16(w[0], w[1]);
+	const __m128i a2 = _mm_unpacklo_epi16(w[2], w[3]);
+	const __m128i a3 = _mm_unpackhi_epi16(w[2], w[3]);
+	const __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+	const __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+	const __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+	const __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+	c[0] = _mm_unpacklo_epi64(b0, b2);
+	c[1] = _mm_unpackhi_epi64(b0, b2);
+	c[2] = _mm_unpacklo_epi64(b1, b3);
+}
+
+// Loads 16 pixels and returns them as 3 channels of 16 words each, in Y, U, V (or R, G, B) order.
+static inline void load_16_yuv_i16(const byte* src, int precision, int precisionShift, bool roundHalf, __m128i* lo, __m128i* hi)
+{
+	__m128i w[4];
+	load_8_i16(src, precision, roundHalf, w);
+	deinterleave_8_i16(w, lo);
+	load_8_i16(src + (8 << precisionShift), precision, roundHalf, w);
+	deinterleave_8_i16(w, hi);
+	if (precision == 1) {
+		// X8R8G8B8 stores V first
+		__m128i tmp = lo[0];
+		lo[0] = lo[2];
+		lo[2] = tmp;
+		tmp = hi[0];
+		hi[0] = hi[2];
+		hi[2] = tmp;
+	}
+}
+
+// Reduces 16 words into 16 bytes, rounding UINT16 values the same way as sadd16(x, 128) >> 8.
+static inline __m128i pack_16_i8(__m128i lo, __m128i hi, int precision)
+{
+	if (precision > 1) {
+		const __m128i round = _mm_set1_epi16(128);
+		lo = _mm_srli_epi16(_mm_adds_epu16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_adds_epu16(hi, round), 8);
+	}
+	return _mm_packus_epi16(lo, hi);
+}
+
+// SIMD version of convFloatToYV24, 16 pixels at a time.
+void ConvertFromShader::convFloatToYV24_simd(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
 	if (stack16)
 		height >>= 1;
 
-	for (int y = 0; y < height; ++y) {
-		if (precision == 3) {
-			// Copy half-float data back into frame
-			env->BitBlt(halfFloatBuffer, halfFloatBufferPitch, src, pitch1, width << 3, 1);
+	const int lsbOffsetY = pitch2Y * height;
+	const int lsbOffsetUV = pitch2UV * height;
+	const int widthMod = width & ~15;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask_lsb = _mm_set1_epi16(0x00FF);
+	__m128i lo[3], hi[3];
+	unsigned char* dstPlane[3];
+	int lsbOffset[3] = { lsbOffsetY, lsbOffsetUV, lsbOffsetUV };
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += yStart * pitch2UV;
+	pv += yStart * pitch2UV;
+	for (int y = yStart; y < yEnd; ++y) {
+		dstPlane[0] = py;
+		dstPlane[1] = pu;
+		dstPlane[2] = pv;
+		for (int x = 0; x < widthMod; x += 16) {
+			load_16_yuv_i16(src + (x << precisionShift), precision, precisionShift, stack16, lo, hi);
+			for (int i = 0; i < 3; i++) {
+				if (!stack16)
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dstPlane[i] + x), pack_16_i8(lo[i], hi[i], precision));
+				else if (precision == 1) {
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dstPlane[i] + x), _mm_packus_epi16(lo[i], hi[i]));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dstPlane[i] + x + lsbOffset[i]), zero);
+				}
+				else {
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dstPlane[i] + x), _mm_packus_epi16(_mm_srli_epi16(lo[i], 8), _mm_srli_epi16(hi[i], 8)));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dstPlane[i] + x + lsbOffset[i]), _mm_packus_epi16(_mm_and_si128(lo[i], mask_lsb), _mm_and_si128(hi[i], mask_lsb)));
+				}
+			}
+		}
+
+		(this->*convRowYuv)(src, py, pu, pv, lsbOffsetY, lsbOffsetUV, widthMod, width);
 
-			// Convert float buffer to half-float
-			DirectX::PackedVector::XMConvertHalfToFloatStream((float*)floatBuffer, 4, (DirectX::PackedVector::HALF*)halfFloatBuffer, 2, width << 2);
+		src += pitch1;
+		py += pitch2Y;
+		pu += pitch2UV;
+		pv += pitch2UV;
+	}
+}
+
+// SIMD version of convFloatToRGB32 for RGB24 and RGB32, 16 pixels at a time. Stack16 isn't supported for RGB.
+void ConvertFromShader::convFloatToRGB32_simd(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd)
+{
+	const int widthMod = width & ~15;
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const __m128i shuffle_rgb24 = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const bool isRGB32 = viDst.IsRGB32();
+	__m128i lo[3], hi[3], bgra[4];
+
+	src += yStart * pitchSrc;
+	dst += (height - yStart) * pitchDst;
+	for (int y = yStart; y < yEnd; ++y) {
+		dst -= pitchDst;
+		for (int x = 0; x < widthMod; x += 16) {
+			load_16_yuv_i16(src + (x << precisionShift), precision, precisionShift, false, lo, hi);
+			const __m128i r = pack_16_i8(lo[0], hi[0], precision);
+			const __m128i g = pack_16_i8(lo[1], hi[1], precision);
+			const __m128i b = pack_16_i8(lo[2], hi[2], precision);
+
+			const __m128i bgLo = _mm_unpacklo_epi8(b, g);
+			const __m128i bgHi = _mm_unpackhi_epi8(b, g);
+			const __m128i raLo = _mm_unpacklo_epi8(r, alpha);
+			const __m128i raHi = _mm_unpackhi_epi8(r, alpha);
+			bgra[0] = _mm_unpacklo_epi16(bgLo, raLo);
+			bgra[1] = _mm_unpackhi_epi16(bgLo, raLo);
+			bgra[2] = _mm_unpacklo_epi16(bgHi, raHi);
+			bgra[3] = _mm_unpackhi_epi16(bgHi, raHi);
+
+			if (isRGB32) {
+				__m128i* dstLoop = reinterpret_cast<__m128i*>(dst + (x << 2));
+				for (int i = 0; i < 4; i++) {
+					_mm_storeu_si128(dstLoop + i, bgra[i]);
+				}
+			}
+			else {
+				// Drop alpha bytes and join 4 blocks of 12 bytes into 3 registers.
+				for (int i = 0; i < 4; i++) {
+					bgra[i] = _mm_shuffle_epi8(bgra[i], shuffle_rgb24);
+				}
+				__m128i* dstLoop = reinterpret_cast<__m128i*>(dst + x * 3);
+				_mm_storeu_si128(dstLoop, _mm_or_si128(bgra[0], _mm_slli_si128(bgra[1], 12)));
+				_mm_storeu_si128(dstLoop + 1, _mm_or_si128(_mm_srli_si128(bgra[1], 4), _mm_slli_si128(bgra[2], 8)));
+				_mm_storeu_si128(dstLoop + 2, _mm_or_si128(_mm_srli_si128(bgra[2], 8), _mm_slli_si128(bgra[3], 4)));
+			}
+		}
+
+		(this->*convRowRgb)(src, dst, widthMod, width);
+
+		src += pitchSrc;
+	}
+}
+
+#define clamp(n, lower, upper) max(lower, min(n, upper))
+
+// Converts texture data into YV12, NV12, P010, P016 or high bit depth 4:2:0. Each pair of rows is unpacked into 16-bit rows, luma is written as is
+// and chroma is averaged vertically and filtered horizontally before being written, without going through YV24.
+void ConvertFromShader::convFloatTo420(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
+	if (stack16)
+		height >>= 1;
+
+	// Stack16 LSB planes are stored below the MSB planes
+	const int chromaWidth = width >> 1;
+	const int lsbOffsetY = pitch2Y * height;
+	const int lsbOffsetUV = pitch2UV * (height >> 1);
+
+	// Two rows of Y, U and V words, then the vertically-averaged row and the downsampled row.
+	const int bufferPitch = (width + 31) & ~15;
+	static thread_local ScratchBuffer buffer, errorBuffer;
+	uint16_t* rowY = buffer.Get<uint16_t>(bufferPitch * 8 + 16) + 8;
+	uint16_t* rowU[2] = { rowY + bufferPitch, rowY + bufferPitch * 2 };
+	uint16_t* rowV[2] = { rowY + bufferPitch * 3, rowY + bufferPitch * 4 };
+	uint16_t* tmp = rowY + bufferPitch * 5;
+	uint16_t* rowC[2] = { rowY + bufferPitch * 6, rowY + bufferPitch * 7 };
+
+	// Error diffusion keeps separate error rows for luma and chroma.
+	int* errorY = dither == 2 ? errorBuffer.Get<int>((width + 2) * 16) : NULL;
+	int* errorC = errorY + (width + 2) * 8;
+	const uint16_t* ditherSrc[2];
+	unsigned char* ditherDst[2];
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += (yStart >> 1) * pitch2UV;
+	pv += (yStart >> 1) * pitch2UV;
+	for (int y = yStart; y < yEnd; y += 2) {
+		for (int i = 0; i < 2; i++) {
+			unpackRowWords(src, rowY, rowU[i], rowV[i], width);
+			if (dither)
+				ditherRows(&rowY, &py, 1, width, y + i, errorY);
+			else
+				packRowWords(rowY, py, py + lsbOffsetY, width);
 			src += pitch1;
+			py += pitch2Y;
 		}
 
-		if (stack16) {
-			for (int x = 0; x < width; ++x) {
-				convStack16(srcLoop + (x << precisionShift), &py[x], &pu[x], &pv[x], &py[x + pitch2Y + height], &pu[x + pitch2UV + height], &pv[x + pitch2UV + height]);
+		downsampleChromaRow(rowU[0], rowU[1], tmp, rowC[0], chromaWidth);
+		downsampleChromaRow(rowV[0], rowV[1], tmp, rowC[1], chromaWidth);
+		if (dither) {
+			// NV12 chroma is dithered into the free tmp row first, then interleaved.
+			ditherSrc[0] = rowC[0];
+			ditherSrc[1] = rowC[1];
+			ditherDst[0] = semiPlanar ? (unsigned char*)tmp : pu;
+			ditherDst[1] = semiPlanar ? (unsigned char*)tmp + chromaWidth : pv;
+			ditherRows(ditherSrc, ditherDst, 2, chromaWidth, y >> 1, errorC);
+			if (semiPlanar)
+				interleaveRowBytes(ditherDst[0], ditherDst[1], pu, chromaWidth);
+		}
+		else if (semiPlanar)
+			packRowWordsInterleaved(rowC[0], rowC[1], pu, chromaWidth);
+		else {
+			packRowWords(rowC[0], pu, pu + lsbOffsetUV, chromaWidth);
+			packRowWords(rowC[1], pv, pv + lsbOffsetUV, chromaWidth);
+		}
+		pu += pitch2UV;
+		pv += pitch2UV;
+	}
+}
+
+// Converts texture data into high bit depth 4:4:4 or planar RGB.
+void ConvertFromShader::convFloatToPlanar16(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
+	const int bufferPitch = (width + 15) & ~7;
+	static thread_local ScratchBuffer buffer;
+	uint16_t* rowY = buffer.Get<uint16_t>(bufferPitch * 3);
+	uint16_t* rowU = rowY + bufferPitch;
+	uint16_t* rowV = rowY + bufferPitch * 2;
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += yStart * pitch2UV;
+	pv += yStart * pitch2UV;
+	for (int y = yStart; y < yEnd; ++y) {
+		unpackRowWords(src, rowY, rowU, rowV, width);
+		packRowWords(rowY, py, NULL, width);
+		packRowWords(rowU, pu, NULL, width);
+		packRowWords(rowV, pv, NULL, width);
+		src += pitch1;
+		py += pitch2Y;
+		pu += pitch2UV;
+		pv += pitch2UV;
+	}
+}
+
+// Converts texture data into 32-bit float 4:4:4 or planar RGB. Half-float values are kept as is, without clamping.
+void ConvertFromShader::convFloatToPlanarFloat(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
+	const int bufferPitch = (width + 15) & ~7;
+	static thread_local ScratchBuffer buffer;
+	uint16_t* words = precision < 3 ? buffer.Get<uint16_t>(bufferPitch * 3) : NULL;
+	uint16_t* rowWords[3] = { words, words + bufferPitch, words + bufferPitch * 2 };
+	const __m128 scale = _mm_set1_ps(precision == 1 ? 1.0f / 255 : 1.0f / 65535);
+	const __m128i zero = _mm_setzero_si128();
+	const int widthMod = useSimd ? width & ~7 : 0;
+	float* out[3];
+	__m128 px[4];
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += yStart * pitch2UV;
+	pv += yStart * pitch2UV;
+	for (int y = yStart; y < yEnd; ++y) {
+		out[0] = (float*)py;
+		out[1] = (float*)pu;
+		out[2] = (float*)pv;
+		if (precision == 3) {
+			for (int x = 0; x < widthMod; x += 4) {
+				// 4 pixels of Y, U, V, A are transposed into 4 values of each channel.
+				const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (x << 3)));
+				const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (x << 3) + 16));
+				px[0] = _mm_cvtph_ps(lo);
+				px[1] = _mm_cvtph_ps(_mm_srli_si128(lo, 8));
+				px[2] = _mm_cvtph_ps(hi);
+				px[3] = _mm_cvtph_ps(_mm_srli_si128(hi, 8));
+				_MM_TRANSPOSE4_PS(px[0], px[1], px[2], px[3]);
+				for (int i = 0; i < 3; i++) {
+					_mm_storeu_ps(out[i] + x, px[i]);
+				}
+			}
+			const DirectX::PackedVector::HALF* pIn = (const DirectX::PackedVector::HALF*)src;
+			for (int x = widthMod; x < width; ++x) {
+				for (int i = 0; i < 3; i++) {
+					out[i][x] = DirectX::PackedVector::XMConvertHalfToFloat(pIn[(x << 2) + i]);
+				}
 			}
 		}
 		else {
-			for (int x = 0; x < width; ++x) {
-				convInt(srcLoop + (x << precisionShift), &py[x], &pu[x], &pv[x]);
+			unpackRowWords(src, rowWords[0], rowWords[1], rowWords[2], width);
+			for (int i = 0; i < 3; i++) {
+				for (int x = 0; x < widthMod; x += 8) {
+					const __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowWords[i] + x));
+					_mm_storeu_ps(out[i] + x, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(val, zero)), scale));
+					_mm_storeu_ps(out[i] + x + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(val, zero)), scale));
+				}
+				for (int x = widthMod; x < width; ++x) {
+					out[i][x] = rowWords[i][x] * (precision == 1 ? 1.0f / 255 : 1.0f / 65535);
+				}
 			}
 		}
 
-		if (precision < 3)
-			srcLoop += srcLoopPitch;
+		src += pitch1;
 		py += pitch2Y;
 		pu += pitch2UV;
 		pv += pitch2UV;
 	}
+}
 
-	if (precision == 3) {
-		delete[] floatBuffer;
-		delete[] halfFloatBuffer;
+// Converts a single-channel texture into Y8, Stack16 Y8 or Y16, rounded or dithered like the other formats.
+void ConvertFromShader::convFloatToLuma(const byte *src, unsigned char *py, int pitch1, int pitch2Y, int width, int height, int yStart, int yEnd)
+{
+	if (stack16)
+		height >>= 1;
+
+	// Stack16 LSB plane is stored below the MSB plane
+	const int lsbOffsetY = pitch2Y * height;
+	const bool copyBytes = precision == 1 && !stack16 && bitsPerComponent == 8;
+
+	static thread_local ScratchBuffer buffer, errorBuffer;
+	uint16_t* rowY = copyBytes ? NULL : buffer.Get<uint16_t>((width + 15) & ~7);
+	int* errors = dither == 2 ? errorBuffer.Get<int>((width + 2) * 8) : NULL;
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	for (int y = yStart; y < yEnd; ++y) {
+		if (copyBytes)
+			memcpy(py, src, width);
+		else {
+			unpackRowLuma(src, rowY, width);
+			if (dither)
+				ditherRows(&rowY, &py, 1, width, y, errors);
+			else
+				packRowWords(rowY, py, py + lsbOffsetY, width);
+		}
+		src += pitch1;
+		py += pitch2Y;
 	}
 }
 
-void ConvertFromShader::convFloatToRGB32(const byte *src, unsigned char *dst,
-	int pitchSrc, int pitchDst, int width, int height, IScriptEnvironment* env) {
+// Converts texture data into YV24 with dithering.
+void ConvertFromShader::convFloatToYV24_dither(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+	int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd)
+{
+	const int bufferPitch = (width + 15) & ~7;
+	static thread_local ScratchBuffer buffer, errorBuffer;
+	uint16_t* words = buffer.Get<uint16_t>(bufferPitch * 3);
+	uint16_t* rowWords[3] = { words, words + bufferPitch, words + bufferPitch * 2 };
+	int* errors = dither == 2 ? errorBuffer.Get<int>((width + 2) * 8) : NULL;
+	unsigned char* dst[3];
+
+	src += yStart * pitch1;
+	py += yStart * pitch2Y;
+	pu += yStart * pitch2UV;
+	pv += yStart * pitch2UV;
+	for (int y = yStart; y < yEnd; ++y) {
+		unpackRowWords(src, rowWords[0], rowWords[1], rowWords[2], width);
+		dst[0] = py;
+		dst[1] = pu;
+		dst[2] = pv;
+		ditherRows(rowWords, dst, 3, width, y, errors);
+		src += pitch1;
+		py += pitch2Y;
+		pu += pitch2UV;
+		pv += pitch2UV;
+	}
+}
 
-	unsigned char *floatBuffer;
-	unsigned char *halfFloatBuffer;
+// Converts texture data into RGB24 or RGB32 with dithering. Rows are dithered into R, G and B rows, then interleaved.
+void ConvertFromShader::convFloatToRGB32_dither(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd)
+{
+	const int bufferPitch = (width + 31) & ~15;
+	static thread_local ScratchBuffer buffer, byteBuffer, errorBuffer;
+	uint16_t* words = buffer.Get<uint16_t>(bufferPitch * 3);
+	unsigned char* bytes = byteBuffer.Get<unsigned char>(bufferPitch * 3);
+	uint16_t* rowWords[3] = { words, words + bufferPitch, words + bufferPitch * 2 };
+	unsigned char* rowBytes[3] = { bytes, bytes + bufferPitch, bytes + bufferPitch * 2 };
+	int* errors = dither == 2 ? errorBuffer.Get<int>((width + 2) * 8) : NULL;
+	const bool isRGB32 = viDst.IsRGB32();
+	const int widthMod = isRGB32 && useSimd ? width & ~15 : 0;
+	const __m128i alpha = _mm_set1_epi8(-1);
+	unsigned char* Val;
 
-	if (precision == 3) {
-		floatBuffer = new unsigned char[floatBufferPitch]; // local 
-		halfFloatBuffer = new unsigned char[halfFloatBufferPitch];
+	src += yStart * pitchSrc;
+	dst += (height - yStart) * pitchDst;
+	for (int y = yStart; y < yEnd; ++y) {
+		dst -= pitchDst;
+		unpackRowWords(src, rowWords[0], rowWords[1], rowWords[2], width);
+		ditherRows(rowWords, rowBytes, 3, width, y, errors);
+
+		for (int x = 0; x < widthMod; x += 16) {
+			const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowBytes[0] + x));
+			const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowBytes[1] + x));
+			const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowBytes[2] + x));
+			const __m128i bgLo = _mm_unpacklo_epi8(b, g);
+			const __m128i bgHi = _mm_unpackhi_epi8(b, g);
+			const __m128i raLo = _mm_unpacklo_epi8(r, alpha);
+			const __m128i raHi = _mm_unpackhi_epi8(r, alpha);
+			__m128i* dstLoop = reinterpret_cast<__m128i*>(dst + (x << 2));
+			_mm_storeu_si128(dstLoop, _mm_unpacklo_epi16(bgLo, raLo));
+			_mm_storeu_si128(dstLoop + 1, _mm_unpackhi_epi16(bgLo, raLo));
+			_mm_storeu_si128(dstLoop + 2, _mm_unpacklo_epi16(bgHi, raHi));
+			_mm_storeu_si128(dstLoop + 3, _mm_unpackhi_epi16(bgHi, raHi));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			Val = isRGB32 ? &dst[x << 2] : &dst[x * 3];
+			Val[0] = rowBytes[2][x];
+			Val[1] = rowBytes[1][x];
+			Val[2] = rowBytes[0][x];
+			if (isRGB32)
+				Val[3] = 255;
+		}
+
+		src += pitchSrc;
 	}
+}
 
-	const byte* srcLoop = precision == 3 ? floatBuffer : src;
-	int srcLoopPitch = precision == 3 ? floatBufferPitch : pitchSrc;
+// 8x8 Bayer matrix, scaled to thresholds between 2 and 254 that replace the rounding constant of 128.
+static const uint16_t bayer8[8][8] = {
+	{   2, 130,  34, 162,  10, 138,  42, 170 },
+	{ 194,  66, 226,  98, 202,  74, 234, 106 },
+	{  50, 178,  18, 146,  58, 186,  26, 154 },
+	{ 242, 114, 210,  82, 250, 122, 218,  90 },
+	{  14, 142,  46, 174,   6, 134,  38, 166 },
+	{ 206,  78, 238, 110, 198,  70, 230, 102 },
+	{  62, 190,  30, 158,  54, 182,  22, 150 },
+	{ 254, 126, 222,  94, 246, 118, 214,  86 }
+};
 
-	if (stack16)
-		height >>= 1;
+// Reduces rows of 16-bit values into 8-bit with ordered or error diffusion dithering.
+// errorBuffer holds 2 rows of (width + 2) * 4 error terms, persisting from one row to the next.
+void ConvertFromShader::ditherRows(const uint16_t* const* src, unsigned char* const* dst, int channels, int width, int y, int* errorBuffer)
+{
+	if (dither == 1) {
+		for (int i = 0; i < channels; i++) {
+			ditherRowOrdered(src[i], dst[i], width, y);
+		}
+	}
+	else {
+		const int errorPitch = (width + 2) * 4;
+		if (y == 0)
+			memset(errorBuffer, 0, errorPitch * sizeof(int));
+		int* errorCur = errorBuffer + (y & 1) * errorPitch;
+		int* errorNext = errorBuffer + (~y & 1) * errorPitch;
+		ditherRowErrorDiffusion(src, dst, channels, width, errorCur, errorNext, (y & 1) != 0);
+	}
+}
 
-	dst += height * pitchDst;
-	unsigned char *Val, *Val2;
+// Ordered dithering with an 8x8 Bayer matrix, 16 pixels at a time.
+void ConvertFromShader::ditherRowOrdered(const uint16_t* src, unsigned char* dst, int width, int y)
+{
+	const uint16_t* thresholds = bayer8[y & 7];
+	const __m128i threshold = _mm_loadu_si128(reinterpret_cast<const __m128i*>(thresholds));
+	const int widthMod = useSimd ? width & ~15 : 0;
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i lo = _mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)), threshold);
+		const __m128i hi = _mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 8)), threshold);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		dst[x] = sadd16(src[x], thresholds[x & 7]) >> 8;
+	}
+}
 
-	for (int y = 0; y < height; ++y) {
-		if (precision == 3) {
-			// Copy frame half-float data into buffer
-			env->BitBlt(halfFloatBuffer, halfFloatBufferPitch, src, pitchSrc, width << 3, 1);
+// Serpentine Floyd-Steinberg error diffusion. Up to 4 channels are processed together, one per 32-bit lane.
+// Errors are kept in 1/16 units: 7/16 goes to the next pixel, 3/16, 5/16 and 1/16 to the row below.
+void ConvertFromShader::ditherRowErrorDiffusion(const uint16_t* const* src, unsigned char* const* dst, int channels, int width, int* errorCur, int* errorNext, bool reverse)
+{
+	const __m128i round8 = _mm_set1_epi32(8);
+	const __m128i round128 = _mm_set1_epi32(128);
+	const __m128i zero = _mm_setzero_si128();
+	const int dir = reverse ? -1 : 1;
+	__m128i carry = zero;
+	int val[4] = { 0, 0, 0, 0 };
 
-			// Convert half-float buffer to float
-			DirectX::PackedVector::XMConvertHalfToFloatStream((float*)floatBuffer, 4, (DirectX::PackedVector::HALF*)halfFloatBuffer, 2, width << 2);
-			src += pitchSrc;
+	memset(errorNext, 0, (width + 2) * 4 * sizeof(int));
+	int x = reverse ? width - 1 : 0;
+	for (int i = 0; i < width; ++i, x += dir) {
+		for (int c = 0; c < channels; c++) {
+			val[c] = src[c][x];
 		}
+		__m128i* errorBelow = reinterpret_cast<__m128i*>(errorNext + ((x + 1) << 2));
+		const __m128i errorIn = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(errorCur + ((x + 1) << 2))), carry);
+		const __m128i value = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(val)), _mm_srai_epi32(_mm_add_epi32(errorIn, round8), 4));
 
-		dst -= pitchDst;
+		// Round to 8-bit and clamp between 0 and 255 with saturating packs.
+		__m128i q = _mm_srai_epi32(_mm_add_epi32(value, round128), 8);
+		q = _mm_packs_epi32(q, q);
+		q = _mm_packus_epi16(q, q);
+		const __m128i error = _mm_sub_epi32(value, _mm_slli_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(q, zero), zero), 8));
 
-		if (viDst.IsRGB32() && stack16) {
-			for (int x = 0; x < width; ++x) {
-				Val = &dst[x << 2];
-				Val2 = Val + pitchDst * height;
-				convStack16(srcLoop + (x << precisionShift), &Val[2], &Val[1], &Val[0], &Val2[2], &Val2[1], &Val2[0]);
-			}
+		const __m128i error3 = _mm_add_epi32(_mm_slli_epi32(error, 1), error);
+		const __m128i error5 = _mm_add_epi32(_mm_slli_epi32(error, 2), error);
+		_mm_storeu_si128(errorBelow - dir, _mm_add_epi32(_mm_loadu_si128(errorBelow - dir), error3));
+		_mm_storeu_si128(errorBelow, _mm_add_epi32(_mm_loadu_si128(errorBelow), error5));
+		_mm_storeu_si128(errorBelow + dir, _mm_add_epi32(_mm_loadu_si128(errorBelow + dir), error));
+		carry = _mm_sub_epi32(_mm_slli_epi32(error, 3), error);
+
+		const int packed = _mm_cvtsi128_si32(q);
+		for (int c = 0; c < channels; c++) {
+			dst[c][x] = (uint8_t)(packed >> (c << 3));
 		}
-		else if (viDst.IsRGB32() && !stack16) {
-			for (int x = 0; x < width; ++x) {
-				Val = &dst[x << 2];
-				convInt(srcLoop + (x << precisionShift), &Val[2], &Val[1], &Val[0]);
-			}
+	}
+}
+
+// Unpacks one row of texture data into 16-bit Y, U and V rows, with the same scale as load_8_i16.
+void ConvertFromShader::unpackRowWords(const byte* src, uint16_t* outY, uint16_t* outU, uint16_t* outV, int width)
+{
+	// Half-float values are rounded when more than 8 bits are kept
+	const bool roundHalf = stack16 || bitsPerComponent > 8 || dither;
+	const int widthMod = useSimd ? width & ~15 : 0;
+	__m128i lo[3], hi[3];
+	uint16_t* out[3] = { outY, outU, outV };
+	for (int x = 0; x < widthMod; x += 16) {
+		load_16_yuv_i16(src + (x << precisionShift), precision, precisionShift, roundHalf, lo, hi);
+		for (int i = 0; i < 3; i++) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[i] + x), lo[i]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[i] + x + 8), hi[i]);
 		}
-		else if (!viDst.IsRGB32() && stack16) {
-			for (int x = 0; x < width; ++x) {
-				Val = &dst[x * 3];
-				Val2 = Val + pitchDst * height;
-				convStack16(srcLoop + (x << precisionShift), &Val[2], &Val[1], &Val[0], &Val2[2], &Val2[1], &Val2[0]);
+	}
+
+	const DirectX::PackedVector::HALF* pIn;
+	for (int x = widthMod; x < width; ++x) {
+		switch (precision) {
+		case 1:
+			outY[x] = src[(x << 2) + 2];
+			outU[x] = src[(x << 2) + 1];
+			outV[x] = src[x << 2];
+			break;
+		case 2:
+			outY[x] = ((const uint16_t*)src)[x << 2];
+			outU[x] = ((const uint16_t*)src)[(x << 2) + 1];
+			outV[x] = ((const uint16_t*)src)[(x << 2) + 2];
+			break;
+		case 3:
+			pIn = (const DirectX::PackedVector::HALF*)src + (x << 2);
+			for (int i = 0; i < 3; i++) {
+				out[i][x] = (uint16_t)(clamp(DirectX::PackedVector::XMConvertHalfToFloat(pIn[i]), 0.0f, 1.0f) * 65535 + (roundHalf ? 0.5f : 0.0f));
 			}
+			break;
 		}
-		else if (!viDst.IsRGB32() && !stack16) {
-			for (int x = 0; x < width; ++x) {
-				Val = &dst[x * 3];
-				convInt(srcLoop + (x << precisionShift), &Val[2], &Val[1], &Val[0]);
-			}
+	}
+}
+
+// Single-channel version of unpackRowWords.
+void ConvertFromShader::unpackRowLuma(const byte* src, uint16_t* outY, int width)
+{
+	const bool roundHalf = stack16 || bitsPerComponent > 8 || dither;
+	const int widthMod = useSimd ? width & ~15 : 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 zeroF = _mm_setzero_ps();
+	const __m128 oneF = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(65535.0f);
+	const DirectX::PackedVector::HALF* pIn = (const DirectX::PackedVector::HALF*)src;
+
+	if (precision == 2) {
+		memcpy(outY, src, width * sizeof(uint16_t));
+		return;
+	}
+	for (int x = 0; x < widthMod; x += 8) {
+		if (precision == 1)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(outY + x), _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x)), zero));
+		else {
+			const __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + x));
+			const __m128 lo = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_cvtph_ps(val), zeroF), oneF), scale);
+			const __m128 hi = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_cvtph_ps(_mm_srli_si128(val, 8)), zeroF), oneF), scale);
+			if (roundHalf)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(outY + x), _mm_packus_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+			else
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(outY + x), _mm_packus_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
 		}
+	}
+	for (int x = widthMod; x < width; ++x) {
+		if (precision == 1)
+			outY[x] = src[x];
+		else
+			outY[x] = (uint16_t)(clamp(DirectX::PackedVector::XMConvertHalfToFloat(pIn[x]), 0.0f, 1.0f) * 65535 + (roundHalf ? 0.5f : 0.0f));
+	}
+}
 
-		if (precision < 3)
-			srcLoop += srcLoopPitch;
+// Writes one row of 16-bit values into a plane, rounded to 8-bit or split into MSB and LSB for Stack16.
+// High bit depth planes get 16-bit samples rounded to their bit depth, left-aligned for P010.
+void ConvertFromShader::packRowWords(const uint16_t* src, unsigned char* dst, unsigned char* dstLsb, int width)
+{
+	const int widthMod = useSimd ? width & ~15 : 0;
+	if (bitsPerComponent > 8) {
+		uint16_t* dstW = (uint16_t*)dst;
+		for (int x = 0; x < widthMod; x += 8) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), roundWords(src + x));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			dstW[x] = roundWord(src[x]);
+		}
+		return;
 	}
-	if (precision == 3) {
-		delete[] floatBuffer;
-		delete[] halfFloatBuffer;
+
+	const __m128i mask_lsb = _mm_set1_epi16(0x00FF);
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+		const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 8));
+		if (!stack16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), pack_16_i8(lo, hi, precision));
+		else if (precision == 1) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstLsb + x), _mm_setzero_si128());
+		}
+		else {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstLsb + x), _mm_packus_epi16(_mm_and_si128(lo, mask_lsb), _mm_and_si128(hi, mask_lsb)));
+		}
+	}
+
+	for (int x = widthMod; x < width; ++x) {
+		if (precision == 1) {
+			dst[x] = (uint8_t)src[x];
+			if (stack16)
+				dstLsb[x] = 0;
+		}
+		else if (stack16) {
+			dst[x] = src[x] >> 8;
+			dstLsb[x] = src[x] & 0xFF;
+		}
+		else
+			dst[x] = sadd16(src[x], 128) >> 8;
 	}
 }
 
-#define clamp(n, lower, upper) max(lower, min(n, upper))
+// Rounds 8 words to the bit depth of the destination. Semi-planar samples are shifted back to the top bits.
+__m128i ConvertFromShader::roundWords(const uint16_t* src)
+{
+	const int shift = 16 - bitsPerComponent;
+	const __m128i roundW = _mm_set1_epi16(shift > 0 ? 1 << (shift - 1) : 0);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m128i countBack = _mm_cvtsi32_si128(semiPlanar ? shift : 0);
+	__m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+	if (precision == 1) // Expand 0-255 to 0-65535
+		val = _mm_or_si128(val, _mm_slli_epi16(val, 8));
+	return _mm_sll_epi16(_mm_srl_epi16(_mm_adds_epu16(val, roundW), count), countBack);
+}
 
+// Scalar version of roundWords.
+uint16_t ConvertFromShader::roundWord(uint16_t src)
+{
+	const int shift = 16 - bitsPerComponent;
+	const uint16_t w = precision == 1 ? src << 8 | src : src;
+	return (sadd16(w, shift > 0 ? 1 << (shift - 1) : 0) >> shift) << (semiPlanar ? shift : 0);
+}
+
+// Writes rows of 16-bit U and V values as interleaved NV12, P010 or P016 chroma, rounded like packRowWords.
+void ConvertFromShader::packRowWordsInterleaved(const uint16_t* srcU, const uint16_t* srcV, unsigned char* dst, int width)
+{
+	const int widthMod = useSimd ? width & ~15 : 0;
+	if (bitsPerComponent > 8) {
+		uint16_t* dstW = (uint16_t*)dst;
+		for (int x = 0; x < widthMod; x += 8) {
+			const __m128i u = roundWords(srcU + x);
+			const __m128i v = roundWords(srcV + x);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + (x << 1)), _mm_unpacklo_epi16(u, v));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + (x << 1) + 8), _mm_unpackhi_epi16(u, v));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			dstW[x << 1] = roundWord(srcU[x]);
+			dstW[(x << 1) + 1] = roundWord(srcV[x]);
+		}
+		return;
+	}
+
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i u = pack_16_i8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x + 8)), precision);
+		const __m128i v = pack_16_i8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x + 8)), precision);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1)), _mm_unpacklo_epi8(u, v));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1) + 16), _mm_unpackhi_epi8(u, v));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		dst[x << 1] = precision == 1 ? (uint8_t)srcU[x] : sadd16(srcU[x], 128) >> 8;
+		dst[(x << 1) + 1] = precision == 1 ? (uint8_t)srcV[x] : sadd16(srcV[x], 128) >> 8;
+	}
+}
+
+// Interleaves rows of 8-bit U and V values into NV12 chroma.
+void ConvertFromShader::interleaveRowBytes(const unsigned char* srcU, const unsigned char* srcV, unsigned char* dst, int width)
+{
+	const int widthMod = useSimd ? width & ~15 : 0;
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x));
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1)), _mm_unpacklo_epi8(u, v));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1) + 16), _mm_unpackhi_epi8(u, v));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		dst[x << 1] = srcU[x];
+		dst[(x << 1) + 1] = srcV[x];
+	}
+}
+
+// Keeps the words at even positions, 2 registers of 8 words into 1.
+static inline __m128i pack_even_i16(__m128i a, __m128i b)
+{
+	a = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 3, 2, 0)), _MM_SHUFFLE(3, 3, 2, 0)), _MM_SHUFFLE(3, 3, 2, 0));
+	b = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 3, 2, 0)), _MM_SHUFFLE(3, 3, 2, 0)), _MM_SHUFFLE(3, 3, 2, 0));
+	return _mm_unpacklo_epi64(a, b);
+}
+
+// Downsamples 2 rows of 16-bit chroma into one row of half width.
+// Rows are averaged vertically. Horizontally, MPEG1 chroma averages 2 samples and MPEG2 chroma is cosited with even samples with a [1 2 1] filter.
+// Averages round up like pavgw.
+void ConvertFromShader::downsampleChromaRow(const uint16_t* row0, const uint16_t* row1, uint16_t* tmp, uint16_t* dst, int chromaWidth)
+{
+	const int width = chromaWidth << 1;
+	const int widthMod = useSimd ? width & ~7 : 0;
+	for (int x = 0; x < widthMod; x += 8) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmp + x), _mm_avg_epu16(a, b));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		tmp[x] = (row0[x] + row1[x] + 1) >> 1;
+	}
+	tmp[-1] = tmp[0];
+	tmp[width] = tmp[width - 1];
+
+	const int chromaWidthMod = useSimd ? chromaWidth & ~7 : 0;
+	__m128i c[2];
+	for (int x = 0; x < chromaWidthMod; x += 8) {
+		for (int i = 0; i < 2; i++) {
+			const uint16_t* p = tmp + (x << 1) + (i << 3);
+			const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+			c[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			if (mpeg1Chroma)
+				c[i] = _mm_avg_epu16(c[i], r);
+			else
+				c[i] = _mm_avg_epu16(c[i], _mm_avg_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p - 1)), r));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), pack_even_i16(c[0], c[1]));
+	}
+	for (int x = chromaWidthMod; x < chromaWidth; ++x) {
+		const uint16_t* p = tmp + (x << 1);
+		if (mpeg1Chroma)
+			dst[x] = (p[0] + p[1] + 1) >> 1;
+		else
+			dst[x] = (p[0] + ((p[-1] + p[1] + 1) >> 1) + 1) >> 1;
+	}
+}
+
+template <int Precision>
 void ConvertFromShader::convInt(const byte* src, unsigned char* outY, unsigned char* outU, unsigned char* outV) {
-	switch (precision) {
+	switch (Precision) {
 	case 1: {
 		outV[0] = src[0];
 		outU[0] = src[1];
@@ -192,30 +1075,31 @@ void ConvertFromShader::convInt(const byte* src, unsigned char* outY, unsigned c
 		break;
 	} case 3: {
 		// colors are in the 0 to 1 range
-		float* pIn = (float*)src;
+		const DirectX::PackedVector::HALF* pIn = (DirectX::PackedVector::HALF*)src;
 		uint16_t y[3];
 		for (int i = 0; i < 3; i++) {
-			y[i] = sadd16((uint16_t)(clamp(pIn[i], 0.0f, 1.0f) * 65535), 128) / 256;
+			y[i] = sadd16((uint16_t)(clamp(DirectX::PackedVector::XMConvertHalfToFloat(pIn[i]), 0.0f, 1.0f) * 65535), 128) >> 8;
 		}
 
 		// Store YUV
-		const uint8_t* pOut3 = (uint8_t*)y;
-		outY[0] = pOut3[0];
-		outU[0] = pOut3[2];
-		outV[0] = pOut3[4];
+		outY[0] = (uint8_t)y[0];
+		outU[0] = (uint8_t)y[1];
+		outV[0] = (uint8_t)y[2];
 		break; }
 	}
 }
 
+template <int Precision>
 void ConvertFromShader::convStack16(const byte* src, unsigned char* outY, unsigned char* outU, unsigned char* outV, unsigned char* outY2, unsigned char* outU2, unsigned char* outV2) {
 	const uint8_t* pOut;
-	float* pIn;
-	switch (precision) {
+	const DirectX::PackedVector::HALF* pIn;
+	uint16_t y[3];
+	switch (Precision) {
 	case 1: {
 		outV[0] = src[0];
 		outU[0] = src[1];
 		outY[0] = src[2];
-		outV2[0] = 0;
+		outY2[0] = 0;
 		outU2[0] = 0;
 		outV2[0] = 0;
 		return;
@@ -224,10 +1108,9 @@ void ConvertFromShader::convStack16(const byte* src, unsigned char* outY, unsign
 		break;
 	} case 3: {
 		// colors are in the 0 to 1 range
-		pIn = (float*)src;
-		uint16_t y[3];
+		pIn = (DirectX::PackedVector::HALF*)src;
 		for (int i = 0; i < 3; i++) {
-			y[i] = sadd16((uint16_t)(clamp(pIn[i], 0.0f, 1.0f) * 65535), 128);
+			y[i] = (uint16_t)(clamp(DirectX::PackedVector::XMConvertHalfToFloat(pIn[i]), 0.0f, 1.0f) * 65535 + 0.5f);
 		}
 
 		// Store YUV
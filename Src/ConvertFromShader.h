@@ -3,28 +3,79 @@
 #include <math.h>
 #include <limits.h>
 #include <DirectXPackedVector.h>
+#include <immintrin.h>
 #include "avisynth.h"
 #include "d3dx9.h"
+#include "ThreadPool.h"
+#include "CpuDispatch.h"
+#include "VideoFormat.h"
 #include <mutex>
+#include <vector>
 
 // Converts float-precision RGB data (12-byte per pixel) into YV12 format.
 class ConvertFromShader : public GenericVideoFilter {
 public:
-	ConvertFromShader(PClip _child, int _precision, const char* _format, bool _stack16, IScriptEnvironment* env);
+	ConvertFromShader(PClip _child, int _precision, const char* _format, bool _stack16, const char* _chromaPlacement, int _dither, int _threads, int _opt, bool _luma, IScriptEnvironment* env);
 	~ConvertFromShader();
 	PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 	const VideoInfo& __stdcall GetVideoInfo() { return viDst; }
 private:
+	// Converts pixels xStart to width of one texture row into YV24 planes, or into RGB24 or RGB32.
+	typedef void (ConvertFromShader::*ConvRowYuvFunc)(const byte* src, unsigned char* py, unsigned char* pu, unsigned char* pv, int lsbOffsetY, int lsbOffsetUV, int xStart, int width);
+	typedef void (ConvertFromShader::*ConvRowRgbFunc)(const byte* src, unsigned char* dst, int xStart, int width);
+
 	const int precision;
+	const bool packed10;
 	const bool stack16;
 	int precisionShift;
-	int floatBufferPitch;
-	int halfFloatBufferPitch;
+	int cpuLevel;
+	bool useSimd;
+	int dither;
+	const int threads;
+	const bool luma;
+	bool mpeg1Chroma;
+	int bitsPerComponent;
+	bool subsampledChroma;
+	bool planarRgb;
+	bool semiPlanar;
 	const char* format;
+	ConvRowYuvFunc convRowYuv;
+	ConvRowRgbFunc convRowRgb;
 	void convFloatToYV24(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
-		int pitch1, int pitch2Y, int pitch2UV, int width, int height, IScriptEnvironment* env);
-	void convFloatToRGB32(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, IScriptEnvironment* env);
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatToRGB32(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd);
+	void convFloatToYV24_simd(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatTo420(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatToPlanar16(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatToPlanarFloat(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatToLuma(const byte *src, unsigned char *py, int pitch1, int pitch2Y, int width, int height, int yStart, int yEnd);
+	void convFloatToYV24_dither(const byte *src, unsigned char *py, unsigned char *pu, unsigned char *pv,
+		int pitch1, int pitch2Y, int pitch2UV, int width, int height, int yStart, int yEnd);
+	void convFloatToRGB32_dither(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd);
+	void ditherRows(const uint16_t* const* src, unsigned char* const* dst, int channels, int width, int y, int* errorBuffer);
+	void ditherRowOrdered(const uint16_t* src, unsigned char* dst, int width, int y);
+	void ditherRowErrorDiffusion(const uint16_t* const* src, unsigned char* const* dst, int channels, int width, int* errorCur, int* errorNext, bool reverse);
+	void unpackRowWords(const byte* src, uint16_t* outY, uint16_t* outU, uint16_t* outV, int width);
+	void unpackRowLuma(const byte* src, uint16_t* outY, int width);
+	void unpackRow10(const byte* src, uint16_t* dst, int width);
+	void packRowWords(const uint16_t* src, unsigned char* dst, unsigned char* dstLsb, int width);
+	void packRowWordsInterleaved(const uint16_t* srcU, const uint16_t* srcV, unsigned char* dst, int width);
+	void interleaveRowBytes(const unsigned char* srcU, const unsigned char* srcV, unsigned char* dst, int width);
+	__m128i roundWords(const uint16_t* src);
+	uint16_t roundWord(uint16_t src);
+	void downsampleChromaRow(const uint16_t* row0, const uint16_t* row1, uint16_t* tmp, uint16_t* dst, int chromaWidth);
+	void convFloatToRGB32_simd(const byte *src, unsigned char *dst, int pitchSrc, int pitchDst, int width, int height, int yStart, int yEnd);
+	template <int Precision, bool Stack16>
+	void convRowToYV24(const byte* src, unsigned char* py, unsigned char* pu, unsigned char* pv, int lsbOffsetY, int lsbOffsetUV, int xStart, int width);
+	template <int Precision, int PixelSize>
+	void convRowToRGB(const byte* src, unsigned char* dst, int xStart, int width);
+	template <int Precision>
 	void convInt(const byte* rgb, unsigned char* outY, unsigned char* outU, unsigned char* outV);
+	template <int Precision>
 	void convStack16(const byte* src, unsigned char* outY, unsigned char* outU, unsigned char* outV, unsigned char* outY2, unsigned char* outU2, unsigned char* outV2);
 	uint16_t ConvertFromShader::sadd16(uint16_t a, uint16_t b);
 	VideoInfo viDst;
@@ -1,32 +1,143 @@
 #include "ConvertToShader.h"
 
-ConvertToShader::ConvertToShader(PClip _child, int _precision, bool _stack16, IScriptEnvironment* env) :
-	GenericVideoFilter(_child), precision(_precision), stack16(_stack16) {
-	if (!vi.IsYV24() && !vi.IsRGB24() && !vi.IsRGB32())
-		env->ThrowError("ConvertToShader: Source must be YV12, YV24, RGB24 or RGB32");
-	if (precision < 1 && precision > 3)
-		env->ThrowError("ConvertToShader: Precision must be 1, 2 or 3");
+ConvertToShader::ConvertToShader(PClip _child, int _precision, bool _stack16, const char* _chromaPlacement, int _threads, int _opt, const char* _format, bool _luma, bool _halfChroma, PClip _alpha, IScriptEnvironment* env) :
+	GenericVideoFilter(_child), precision(_precision == 4 ? 2 : _precision), packed10(_precision == 4), stack16(_stack16), threads(_threads), luma(_luma), halfChroma(_halfChroma), alphaClip(_alpha) {
+	bitsPerComponent = GetBitsPerComponent(vi);
+	semiPlanar = strcmp(_format, "NV12") == 0 || strcmp(_format, "P010") == 0 || strcmp(_format, "P016") == 0;
+	if (*_format && !semiPlanar)
+		env->ThrowError("ConvertToShader: Format must be NV12, P010 or P016");
+	if (semiPlanar) {
+		// Semi-planar frames are stored in a Y8 or Y16 clip, with rows of interleaved U and V below the luma rows.
+		// P010 samples are left-aligned in 16 bits, so P010 and P016 are read the same way.
+		if (strcmp(_format, "NV12") == 0 ? !vi.IsColorSpace(VideoInfo::CS_Y8) : !vi.IsColorSpace(VideoInfo::CS_Y16))
+			env->ThrowError("ConvertToShader: NV12 source must be stored in a Y8 clip, P010 and P016 in a Y16 clip");
+		if (vi.height % 3)
+			env->ThrowError("ConvertToShader: Semi-planar source must have a height of 3/2 the luma height");
+		if (stack16)
+			env->ThrowError("ConvertToShader: Stack16 can't be used with semi-planar source");
+		subsampledChroma = true;
+		planarRgb = false;
+	}
+	else if (luma) {
+		// Only the luma plane is read, so any planar YUV format can be used.
+		if (!vi.IsPlanar() || vi.IsRGB())
+			env->ThrowError("ConvertToShader: Luma requires a planar YUV source");
+		if (stack16 && bitsPerComponent > 8)
+			env->ThrowError("ConvertToShader: Stack16 can't be used with high bit depth source");
+		subsampledChroma = false;
+		planarRgb = false;
+	}
+	else if (bitsPerComponent > 8) {
+		// AviSynth+ high bit depth formats: YUV 4:2:0, YUV 4:4:4 and planar RGB
+		const int genericType = vi.pixel_type & ~VideoInfo::CS_Sample_Bits_Mask;
+		if (genericType != VideoInfo::CS_GENERIC_YUV420 && genericType != VideoInfo::CS_GENERIC_YUV444 && genericType != VideoInfo::CS_GENERIC_RGBP)
+			env->ThrowError("ConvertToShader: High bit depth source must be YUV420, YUV444 or planar RGB");
+		if (bitsPerComponent == 32 && genericType == VideoInfo::CS_GENERIC_YUV420)
+			env->ThrowError("ConvertToShader: YUV420PS isn't supported, use YUV444PS");
+		if (stack16)
+			env->ThrowError("ConvertToShader: Stack16 can't be used with high bit depth source");
+		subsampledChroma = genericType == VideoInfo::CS_GENERIC_YUV420;
+		planarRgb = genericType == VideoInfo::CS_GENERIC_RGBP;
+	}
+	else {
+		if (!vi.IsYV12() && !vi.IsYV24() && !vi.IsRGB24() && !vi.IsRGB32())
+			env->ThrowError("ConvertToShader: Source must be YV12, YV24, RGB24 or RGB32");
+		subsampledChroma = vi.IsYV12();
+		planarRgb = false;
+	}
+	if (_precision < 1 || _precision > 4)
+		env->ThrowError("ConvertToShader: Precision must be 1, 2, 3 or 4");
+	if (packed10 && (luma || halfChroma || alphaClip))
+		env->ThrowError("ConvertToShader: Precision=4 can't be used with Luma, HalfChroma or Alpha");
 	if (stack16 && vi.IsRGB())
 		env->ThrowError("Conversion from Stack16 only supports YV12 and YV24");
+	const int lumaHeight = semiPlanar ? vi.height / 3 * 2 : vi.height;
+	// Stack16 stacks LSB rows below MSB rows, so the luma height of each half must be even.
+	if (subsampledChroma && ((vi.width & 1) || (lumaHeight & (stack16 ? 3 : 1))))
+		env->ThrowError("ConvertToShader: 4:2:0 source requires even width and height");
+	if (strcmp(_chromaPlacement, "MPEG2") != 0 && strcmp(_chromaPlacement, "MPEG1") != 0)
+		env->ThrowError("ConvertToShader: ChromaInPlacement must be MPEG1 or MPEG2");
+	if (luma && halfChroma)
+		env->ThrowError("ConvertToShader: Luma and HalfChroma can't both be used");
+	if (halfChroma && !subsampledChroma)
+		env->ThrowError("ConvertToShader: HalfChroma requires a YV12, YUV420, NV12, P010 or P016 source");
+	if (luma && vi.width * (precision == 1 ? 1 : 2) % 4)
+		env->ThrowError("ConvertToShader: Luma requires a width multiple of 4 with Precision=1, or of 2 otherwise");
+	if (halfChroma && vi.width * (precision == 1 ? 1 : 2) % 4)
+		env->ThrowError("ConvertToShader: HalfChroma requires a width multiple of 4 with Precision=1, or of 2 otherwise");
+	if (alphaClip) {
+		// The first plane of the alpha clip is converted like luma, so it must have the same size and bit depth.
+		const VideoInfo& viA = alphaClip->GetVideoInfo();
+		if (luma || halfChroma)
+			env->ThrowError("ConvertToShader: Alpha can't be used with Luma or HalfChroma");
+		if (!viA.IsPlanar())
+			env->ThrowError("ConvertToShader: Alpha must be a planar clip");
+		if (viA.width != vi.width || viA.height != lumaHeight || GetBitsPerComponent(viA) != bitsPerComponent)
+			env->ThrowError("ConvertToShader: Alpha must have the same size and bit depth as the source");
+	}
+	if (threads < 0)
+		env->ThrowError("ConvertToShader: Threads must be 0 or higher");
+	if (_opt < -1 || _opt > CPU_LEVEL_AVX512)
+		env->ThrowError("ConvertToShader: Opt must be between -1 and 4");
 
 	viDst = vi;
 	viDst.pixel_type = VideoInfo::CS_BGR32;
-	if (precision > 1) // Half-float frame has its width twice larger than normal
+	if (luma || halfChroma) // Single-channel frame has 1 or 2 bytes per pixel
+		viDst.width = vi.width * (precision == 1 ? 1 : 2) / 4;
+	else if (precision > 1 && !packed10) // Half-float frame has its width twice larger than normal
 		viDst.width <<= 1;
 	if (stack16)
 		viDst.height >>= 1;
+	viDst.height = semiPlanar ? lumaHeight : viDst.height;
+	if (halfChroma) // Rows of interleaved U and V at half resolution follow the luma rows
+		viDst.height = viDst.height * 3 / 2;
 
-	if (precision == 1)
-		precisionShift = 2;
-	else if (precision == 2)
-		precisionShift = 3;
-	else
-		precisionShift = 4;
+	mpeg1Chroma = strcmp(_chromaPlacement, "MPEG1") == 0;
+
+	// F16C is a separate feature, only used from the AVX2 level so that lower levels can be forced.
+	int cpuFlags = env->GetCPUFlags();
+	cpuLevel = GetCpuLevel(cpuFlags, _opt);
+	useF16C = cpuLevel >= CPU_LEVEL_AVX2 && (cpuFlags & CPUF_F16C) != 0;
 
 	if (precision == 3) {
-		floatBufferPitch = vi.width << 4;
-		halfFloatBufferPitch = vi.width << 3;
+		// Half-float values of all 8-bit samples, texture shaders expect data between 0 and 1
+		for (int i = 0; i < 256; i++) {
+			halfLut[i] = DirectX::PackedVector::XMConvertFloatToHalf(i * (1.0f / 255));
+		}
 	}
+
+	// Select the kernel that converts one row of YUV data into the texture layout.
+	if (precision == 3)
+		convRow = useF16C ? &ConvertToShader::convRowToHalf_f16c : &ConvertToShader::convRowToHalf;
+	else if (stack16 && precision == 1)
+		convRow = cpuLevel >= CPU_LEVEL_SSE2 ? &ConvertToShader::convRowStack16_sse2<1> : &ConvertToShader::convRowStack16<1>;
+	else if (stack16)
+		convRow = cpuLevel >= CPU_LEVEL_SSE2 ? &ConvertToShader::convRowStack16_sse2<2> : &ConvertToShader::convRowStack16<2>;
+	else if (cpuLevel == CPU_LEVEL_SCALAR)
+		convRow = precision == 1 ? &ConvertToShader::convRowInt<1> : &ConvertToShader::convRowInt<2>;
+	else if (precision == 1)
+		convRow = cpuLevel >= CPU_LEVEL_AVX512 ? &ConvertToShader::bitblt_i8_to_i8_avx512 :
+			cpuLevel >= CPU_LEVEL_AVX2 ? &ConvertToShader::bitblt_i8_to_i8_avx2 : &ConvertToShader::bitblt_i8_to_i8_sse2;
+	else
+		convRow = cpuLevel >= CPU_LEVEL_AVX512 ? &ConvertToShader::bitblt_i8_to_i16_avx512 :
+			cpuLevel >= CPU_LEVEL_AVX2 ? &ConvertToShader::bitblt_i8_to_i16_avx2 : &ConvertToShader::bitblt_i8_to_i16_sse2;
+
+	// RGB sources have one kernel per pixel size and precision.
+	convRgbRow = vi.IsRGB32() ? selectRgbRow<4>() : selectRgbRow<3>();
+}
+
+// Selects the RGB row kernel for the precision and CPU level. Bytes are shuffled with SSSE3, half-float also requires F16C.
+template <int PixelSize>
+ConvertToShader::ConvRgbRowFunc ConvertToShader::selectRgbRow()
+{
+	if (precision == 3)
+		return useF16C && cpuLevel >= CPU_LEVEL_SSSE3 ? &ConvertToShader::convRowRgb_ssse3<3, PixelSize> : &ConvertToShader::convRowRgb<3, PixelSize>;
+	else if (precision == 2)
+		return cpuLevel >= CPU_LEVEL_AVX2 ? &ConvertToShader::convRowRgb_avx2<2, PixelSize> :
+			cpuLevel >= CPU_LEVEL_SSSE3 ? &ConvertToShader::convRowRgb_ssse3<2, PixelSize> : &ConvertToShader::convRowRgb<2, PixelSize>;
+	else
+		return cpuLevel >= CPU_LEVEL_AVX2 ? &ConvertToShader::convRowRgb_avx2<1, PixelSize> :
+			cpuLevel >= CPU_LEVEL_SSSE3 ? &ConvertToShader::convRowRgb_ssse3<1, PixelSize> : &ConvertToShader::convRowRgb<1, PixelSize>;
 }
 
 ConvertToShader::~ConvertToShader() {
@@ -37,243 +148,1218 @@ PVideoFrame __stdcall ConvertToShader::GetFrame(int n, IScriptEnvironment* env)
 
 	// Convert from YV24 to half-float RGB
 	PVideoFrame dst = env->NewVideoFrame(viDst);
-	if (vi.IsRGB())
-		convRgbToFloat(src->GetReadPtr(), dst->GetWritePtr(), src->GetPitch(), dst->GetPitch(), vi.width, vi.height, env);
-	//else if (precision == 2 && !convertYUV)
-	//	bitblt_i8_to_i16_sse2((uint8_t*)src->GetReadPtr(PLANAR_Y), (uint8_t*)src->GetReadPtr(PLANAR_U), (uint8_t*)src->GetReadPtr(PLANAR_V), src->GetPitch(PLANAR_Y), (uint16_t*)dst->GetWritePtr(), dst->GetPitch(), srcHeight);
-	else
-		convYV24ToFloat(src->GetReadPtr(PLANAR_Y), src->GetReadPtr(PLANAR_U), src->GetReadPtr(PLANAR_V), dst->GetWritePtr(), src->GetPitch(PLANAR_Y), src->GetPitch(PLANAR_U), dst->GetPitch(), vi.width, vi.height, env);
+	const int planeY = planarRgb ? PLANAR_R : PLANAR_Y;
+	const int planeU = planarRgb ? PLANAR_G : PLANAR_U;
+	const int planeV = planarRgb ? PLANAR_B : PLANAR_V;
+	const byte* srcY = src->GetReadPtr(planeY);
+	const int srcPitchY = src->GetPitch(planeY);
+	const int lumaHeight = semiPlanar ? vi.height / 3 * 2 : vi.height;
+	const byte *srcU, *srcV;
+	int srcPitchUV, srcHeight;
+	if (semiPlanar) {
+		// Interleaved chroma rows follow the luma rows, each V sample right after its U sample.
+		srcU = srcY + lumaHeight * srcPitchY;
+		srcV = srcU + (bitsPerComponent > 8 ? 2 : 1);
+		srcPitchUV = srcPitchY;
+		srcHeight = lumaHeight;
+	}
+	else if (luma) {
+		srcU = srcV = NULL;
+		srcPitchUV = 0;
+		srcHeight = vi.height;
+	}
+	else {
+		srcU = vi.IsRGB() && !planarRgb ? NULL : src->GetReadPtr(planeU);
+		srcV = vi.IsRGB() && !planarRgb ? NULL : src->GetReadPtr(planeV);
+		srcPitchUV = vi.IsRGB() && !planarRgb ? 0 : src->GetPitch(planeU);
+		srcHeight = vi.height;
+	}
+	unsigned char* dstPtr = dst->GetWritePtr();
+	const int dstPitch = dst->GetPitch();
+	PVideoFrame alpha;
+	if (alphaClip)
+		alpha = alphaClip->GetFrame(n, env);
+	const byte* srcA = alphaClip ? alpha->GetReadPtr() : NULL;
+	const int srcPitchA = alphaClip ? alpha->GetPitch() : 0;
+
+	// Output rows are split into stripes that are converted in parallel.
+	ThreadPool::GetInstance().Run(threads, viDst.height, 1, [&](int yStart, int yEnd) {
+		if (packed10) {
+			// Each row is converted into UINT16 words, then packed into 10-bit while still in cache.
+			static thread_local ScratchBuffer wordBuffer;
+			uint16_t* words = wordBuffer.Get<uint16_t>(vi.width * 4 + 32);
+			for (int y = yStart; y < yEnd; ++y) {
+				convRows(srcY, srcU, srcV, srcA, (unsigned char*)words, srcPitchY, srcPitchUV, srcPitchA, 0, srcHeight, y, y + 1);
+				packRow10(words, dstPtr + y * dstPitch, vi.width);
+			}
+		}
+		else
+			convRows(srcY, srcU, srcV, srcA, dstPtr, srcPitchY, srcPitchUV, srcPitchA, dstPitch, srcHeight, yStart, yEnd);
+	});
 
 	return dst;
 }
 
-void ConvertToShader::convYV24ToFloat(const byte *py, const byte *pu, const byte *pv,
-	unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, IScriptEnvironment* env)
+// Converts a range of rows with the converter matching the source format.
+void ConvertToShader::convRows(const byte *srcY, const byte *srcU, const byte *srcV, const byte *srcA, unsigned char *dst,
+	int srcPitchY, int srcPitchUV, int srcPitchA, int dstPitch, int srcHeight, int yStart, int yEnd)
 {
-	unsigned char *floatBuffer;
-	unsigned char *halfFloatBuffer;
+	if (halfChroma)
+		convHalfChromaToShader(srcY, srcU, srcV, dst, srcPitchY, srcPitchUV, dstPitch, vi.width, srcHeight, yStart, yEnd);
+	else if (luma)
+		convLumaToShader(srcY, dst, srcPitchY, dstPitch, vi.width, srcHeight, yStart, yEnd);
+	else if (bitsPerComponent > 8)
+		convHighBitDepthToShader(srcY, srcU, srcV, dst, srcPitchY, srcPitchUV, dstPitch, vi.width, srcHeight, yStart, yEnd);
+	else if (vi.IsRGB())
+		convRgbToShader(srcY, dst, srcPitchY, dstPitch, vi.width, srcHeight, yStart, yEnd);
+	else
+		convYuvToShader(srcY, srcU, srcV, dst, srcPitchY, srcPitchUV, dstPitch, vi.width, srcHeight, yStart, yEnd);
+	if (alphaClip)
+		convAlphaToShader(srcA, dst, srcPitchA, dstPitch, vi.width, alphaClip->GetVideoInfo().height, yStart, yEnd);
+}
 
-	if (precision == 3) {
-		floatBuffer = new unsigned char[floatBufferPitch]; // C++ 
-		halfFloatBuffer = new unsigned char[halfFloatBufferPitch];
+// Converts YV12, NV12 or YV24 data, 8-bit or Stack16, one row at a time. 4:2:0 chroma is upsampled into a row buffer right before the row is packed.
+void ConvertToShader::convYuvToShader(const byte *py, const byte *pu, const byte *pv,
+	unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd)
+{
+	if (stack16)
+		height >>= 1;
+
+	// Stack16 LSB planes are stored below the MSB planes
+	const int chromaHeight = subsampledChroma ? height >> 1 : height;
+	const int lsbOffsetY = pitch1Y * height;
+	const int lsbOffsetUV = pitch1UV * chromaHeight;
+
+	// Row buffers for upsampled chroma: U, V, then U and V LSB for Stack16.
+	const int chromaWidth = width >> 1;
+	const int bufferPitch = (width + 63) & ~31;
+	static thread_local ScratchBuffer chromaBuffer, tmpBuffer;
+	uint8_t* upU = subsampledChroma ? chromaBuffer.Get<uint8_t>(bufferPitch * (stack16 ? 4 : 2)) : NULL;
+	uint8_t* upV = upU + bufferPitch;
+	int* tmpRow = subsampledChroma ? tmpBuffer.Get<int>(chromaWidth + 16) : NULL;
+
+	const byte *rowY, *rowU, *rowV;
+	dst += yStart * pitch2;
+	for (int y = yStart; y < yEnd; ++y) {
+		rowY = py + y * pitch1Y;
+		if (subsampledChroma) {
+			// Chroma rows are sited halfway between 2 luma rows.
+			const int nearRow = y >> 1;
+			const int farRow = (y & 1) ? min(nearRow + 1, chromaHeight - 1) : max(nearRow - 1, 0);
+			if (semiPlanar)
+				upsampleChromaRowNV12(pu + nearRow * pitch1UV, pu + farRow * pitch1UV, (uint16_t*)tmpRow, upU, upV, chromaWidth);
+			else if (stack16) {
+				upsampleChromaRow16(pu + nearRow * pitch1UV, pu + farRow * pitch1UV, lsbOffsetUV, tmpRow, upU, upU + bufferPitch * 2, chromaWidth);
+				upsampleChromaRow16(pv + nearRow * pitch1UV, pv + farRow * pitch1UV, lsbOffsetUV, tmpRow, upV, upV + bufferPitch * 2, chromaWidth);
+			}
+			else {
+				upsampleChromaRow(pu + nearRow * pitch1UV, pu + farRow * pitch1UV, (uint16_t*)tmpRow, upU, chromaWidth);
+				upsampleChromaRow(pv + nearRow * pitch1UV, pv + farRow * pitch1UV, (uint16_t*)tmpRow, upV, chromaWidth);
+			}
+			rowU = upU;
+			rowV = upV;
+			(this->*convRow)(rowY, rowU, rowV, stack16 ? rowY + lsbOffsetY : NULL, rowU + bufferPitch * 2, rowV + bufferPitch * 2, dst, width);
+		}
+		else {
+			rowU = pu + y * pitch1UV;
+			rowV = pv + y * pitch1UV;
+			(this->*convRow)(rowY, rowU, rowV, stack16 ? rowY + lsbOffsetY : NULL, rowU + lsbOffsetUV, rowV + lsbOffsetUV, dst, width);
+		}
+		dst += pitch2;
 	}
+}
 
-	unsigned char* dstLoop = precision == 3 ? floatBuffer : dst;
-	int dstLoopPitch = precision == 3 ? floatBufferPitch : pitch2;
+// Upsamples one row of 4:2:0 chroma horizontally and vertically.
+// nearRow is the chroma row closest to the luma row and gets 3/4 of the weight, farRow gets 1/4.
+// Horizontally, MPEG1 chroma is centered between 2 luma samples and MPEG2 chroma is cosited with even luma samples.
+void ConvertToShader::upsampleChromaRow(const byte* nearRow, const byte* farRow, uint16_t* tmp, unsigned char* dst, int chromaWidth)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? chromaWidth & ~7 : 0;
+	uint16_t* tmpRow = tmp + 1;
 
-	if (stack16)
-		height >>= 1;
+	// Vertical pass, values are scaled by 4.
+	for (int x = 0; x < widthMod; x += 8) {
+		const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(nearRow + x)), zero);
+		const __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(farRow + x)), zero);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmpRow + x), _mm_add_epi16(_mm_add_epi16(a, _mm_slli_epi16(a, 1)), b));
+	}
+	for (int x = widthMod; x < chromaWidth; ++x) {
+		tmpRow[x] = nearRow[x] * 3 + farRow[x];
+	}
+	interpolateChromaRow(tmpRow, dst, chromaWidth);
+}
 
-	// Convert all data to float
-	unsigned char Y, U, V, Y2, U2, V2;
+// NV12 version of upsampleChromaRow. U and V are split while summing the rows, so that each is interpolated from its own row buffer.
+void ConvertToShader::upsampleChromaRowNV12(const byte* nearRow, const byte* farRow, uint16_t* tmp, unsigned char* dstU, unsigned char* dstV, int chromaWidth)
+{
+	const __m128i mask_lsb = _mm_set1_epi16(0x00FF);
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? chromaWidth & ~7 : 0;
+	uint16_t* tmpU = tmp + 1;
+	uint16_t* tmpV = tmpU + chromaWidth + 16;
 
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			Y = py[x];
-			U = pu[x];
-			V = pv[x];
-
-			if (stack16) {
-				Y2 = Y + pitch1Y * height;
-				U2 = U + pitch1UV * height;
-				V2 = V + pitch1UV * height;
-				convStack16(Y, U, V, Y2, U2, V2, dstLoop + (x << precisionShift));
+	// 16 bytes hold 8 pairs of U and V, U in the low byte of each word.
+	for (int x = 0; x < widthMod; x += 8) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nearRow + (x << 1)));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(farRow + (x << 1)));
+		const __m128i aU = _mm_and_si128(a, mask_lsb);
+		const __m128i aV = _mm_srli_epi16(a, 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmpU + x), _mm_add_epi16(_mm_add_epi16(aU, _mm_slli_epi16(aU, 1)), _mm_and_si128(b, mask_lsb)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(tmpV + x), _mm_add_epi16(_mm_add_epi16(aV, _mm_slli_epi16(aV, 1)), _mm_srli_epi16(b, 8)));
+	}
+	for (int x = widthMod; x < chromaWidth; ++x) {
+		tmpU[x] = nearRow[x << 1] * 3 + farRow[x << 1];
+		tmpV[x] = nearRow[(x << 1) + 1] * 3 + farRow[(x << 1) + 1];
+	}
+	interpolateChromaRow(tmpU, dstU, chromaWidth);
+	interpolateChromaRow(tmpV, dstV, chromaWidth);
+}
+
+// Horizontal pass of upsampleChromaRow, values are scaled by 16 and rounded back to 8-bit.
+// tmpRow holds the vertically-summed row and needs one free value on each side.
+void ConvertToShader::interpolateChromaRow(uint16_t* tmpRow, unsigned char* dst, int chromaWidth)
+{
+	const __m128i round = _mm_set1_epi16(8);
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? chromaWidth & ~7 : 0;
+	tmpRow[-1] = tmpRow[0];
+	tmpRow[chromaWidth] = tmpRow[chromaWidth - 1];
+
+	__m128i even, odd;
+	for (int x = 0; x < widthMod; x += 8) {
+		const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmpRow + x));
+		const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmpRow + x + 1));
+		if (mpeg1Chroma) {
+			const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmpRow + x - 1));
+			const __m128i c3 = _mm_add_epi16(c, _mm_slli_epi16(c, 1));
+			even = _mm_add_epi16(c3, l);
+			odd = _mm_add_epi16(c3, r);
+		}
+		else {
+			even = _mm_slli_epi16(c, 2);
+			odd = _mm_slli_epi16(_mm_add_epi16(c, r), 1);
+		}
+		even = _mm_srli_epi16(_mm_add_epi16(even, round), 4);
+		odd = _mm_srli_epi16(_mm_add_epi16(odd, round), 4);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1)), _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd)));
+	}
+	for (int x = widthMod; x < chromaWidth; ++x) {
+		if (mpeg1Chroma) {
+			dst[x << 1] = (tmpRow[x] * 3 + tmpRow[x - 1] + 8) >> 4;
+			dst[(x << 1) + 1] = (tmpRow[x] * 3 + tmpRow[x + 1] + 8) >> 4;
+		}
+		else {
+			dst[x << 1] = (tmpRow[x] * 4 + 8) >> 4;
+			dst[(x << 1) + 1] = ((tmpRow[x] + tmpRow[x + 1]) * 2 + 8) >> 4;
+		}
+	}
+}
+
+// Stack16 version of upsampleChromaRow. LSB rows are found lsbOffset bytes after the MSB rows.
+void ConvertToShader::upsampleChromaRow16(const byte* nearRow, const byte* farRow, int lsbOffset, int* tmp, unsigned char* dst, unsigned char* dstLsb, int chromaWidth)
+{
+	int* tmpRow = tmp + 1;
+	for (int x = 0; x < chromaWidth; ++x) {
+		tmpRow[x] = (nearRow[x] << 8 | nearRow[x + lsbOffset]) * 3 + (farRow[x] << 8 | farRow[x + lsbOffset]);
+	}
+	tmpRow[-1] = tmpRow[0];
+	tmpRow[chromaWidth] = tmpRow[chromaWidth - 1];
+
+	int even, odd;
+	for (int x = 0; x < chromaWidth; ++x) {
+		if (mpeg1Chroma) {
+			even = (tmpRow[x] * 3 + tmpRow[x - 1] + 8) >> 4;
+			odd = (tmpRow[x] * 3 + tmpRow[x + 1] + 8) >> 4;
+		}
+		else {
+			even = (tmpRow[x] * 4 + 8) >> 4;
+			odd = ((tmpRow[x] + tmpRow[x + 1]) * 2 + 8) >> 4;
+		}
+		dst[x << 1] = even >> 8;
+		dstLsb[x << 1] = even & 0xFF;
+		dst[(x << 1) + 1] = odd >> 8;
+		dstLsb[(x << 1) + 1] = odd & 0xFF;
+	}
+}
+
+// Converts AviSynth+ high bit depth or float planar data, or P010 and P016, one row at a time. 4:2:0 chroma is upsampled into a row buffer first.
+// Planar RGB is handled like YUV with R, G and B in place of Y, U and V.
+void ConvertToShader::convHighBitDepthToShader(const byte *p0, const byte *p1, const byte *p2,
+	unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd)
+{
+	const bool isFloat = bitsPerComponent == 32;
+	const int chromaHeight = subsampledChroma ? height >> 1 : height;
+	const int chromaWidth = width >> 1;
+	const int step = semiPlanar ? 2 : 1;
+
+	// Row buffers for upsampled chroma, or for float samples converted into words.
+	const int bufferPitch = (width + 15) & ~7;
+	static thread_local ScratchBuffer wordBuffer, tmpBuffer;
+	uint16_t* wordRows = wordBuffer.Get<uint16_t>(bufferPitch * 3);
+	uint16_t* words[3] = { wordRows, wordRows + bufferPitch, wordRows + bufferPitch * 2 };
+	int* tmpRow = subsampledChroma ? tmpBuffer.Get<int>(chromaWidth + 16) : NULL;
+
+	// Integer formats are scaled to 16-bit for UINT16 and BYTE textures, or to 0-1 for half-float textures.
+	const int shift = isFloat ? 0 : 16 - bitsPerComponent;
+	const float scale = 1.0f / ((1 << bitsPerComponent) - 1);
+
+	const byte* row[3];
+	dst += yStart * pitch2;
+	for (int y = yStart; y < yEnd; ++y) {
+		row[0] = p0 + y * pitch1Y;
+		if (subsampledChroma) {
+			const int nearRow = y >> 1;
+			const int farRow = (y & 1) ? min(nearRow + 1, chromaHeight - 1) : max(nearRow - 1, 0);
+			upsampleChromaRowWords((const uint16_t*)(p1 + nearRow * pitch1UV), (const uint16_t*)(p1 + farRow * pitch1UV), step, tmpRow, words[1], chromaWidth);
+			upsampleChromaRowWords((const uint16_t*)(p2 + nearRow * pitch1UV), (const uint16_t*)(p2 + farRow * pitch1UV), step, tmpRow, words[2], chromaWidth);
+			row[1] = (const byte*)words[1];
+			row[2] = (const byte*)words[2];
+		}
+		else {
+			row[1] = p1 + y * pitch1UV;
+			row[2] = p2 + y * pitch1UV;
+		}
+
+		if (isFloat && precision == 3)
+			convRowFloatToHalf((const float*)row[0], (const float*)row[1], (const float*)row[2], dst, width);
+		else if (isFloat) {
+			for (int i = 0; i < 3; i++) {
+				convRowFloatToWords((const float*)row[i], words[i], width);
 			}
-			else
-				convInt(Y, U, V, dstLoop + (x << precisionShift));
+			convRowWords(words[0], words[1], words[2], 0, dst, width);
+		}
+		else if (precision == 3)
+			convRowWordsToHalf((const uint16_t*)row[0], (const uint16_t*)row[1], (const uint16_t*)row[2], scale, dst, width);
+		else
+			convRowWords((const uint16_t*)row[0], (const uint16_t*)row[1], (const uint16_t*)row[2], shift, dst, width);
+		dst += pitch2;
+	}
+}
+
+// High bit depth version of upsampleChromaRow, values keep their bit depth.
+// Samples are step words apart, 2 to read U or V from interleaved P010 and P016 chroma.
+void ConvertToShader::upsampleChromaRowWords(const uint16_t* nearRow, const uint16_t* farRow, int step, int* tmp, uint16_t* dst, int chromaWidth)
+{
+	int* tmpRow = tmp + 1;
+	for (int x = 0; x < chromaWidth; ++x) {
+		tmpRow[x] = nearRow[x * step] * 3 + farRow[x * step];
+	}
+	tmpRow[-1] = tmpRow[0];
+	tmpRow[chromaWidth] = tmpRow[chromaWidth - 1];
+
+	for (int x = 0; x < chromaWidth; ++x) {
+		if (mpeg1Chroma) {
+			dst[x << 1] = (tmpRow[x] * 3 + tmpRow[x - 1] + 8) >> 4;
+			dst[(x << 1) + 1] = (tmpRow[x] * 3 + tmpRow[x + 1] + 8) >> 4;
+		}
+		else {
+			dst[x << 1] = (tmpRow[x] * 4 + 8) >> 4;
+			dst[(x << 1) + 1] = ((tmpRow[x] + tmpRow[x + 1]) * 2 + 8) >> 4;
+		}
+	}
+}
+
+// Converts one row of float samples into 16-bit words, clamped between 0 and 1.
+void ConvertToShader::convRowFloatToWords(const float* src, uint16_t* dst, int width)
+{
+	const __m128 zeroF = _mm_setzero_ps();
+	const __m128 oneF = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(65535.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128i bias = _mm_set1_epi32(32768);
+	const __m128i signFlip = _mm_set1_epi16(-32768);
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? width & ~7 : 0;
+	for (int x = 0; x < widthMod; x += 8) {
+		// Packing 32-bit integers with unsigned saturation requires SSE4.1, so values are biased into signed range.
+		const __m128 lo = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + x), zeroF), oneF), scale), half);
+		const __m128 hi = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + x + 4), zeroF), oneF), scale), half);
+		const __m128i packed = _mm_packs_epi32(_mm_sub_epi32(_mm_cvttps_epi32(lo), bias), _mm_sub_epi32(_mm_cvttps_epi32(hi), bias));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_xor_si128(packed, signFlip));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		dst[x] = (uint16_t)(min(max(src[x], 0.0f), 1.0f) * 65535 + 0.5f);
+	}
+}
+
+// Converts one row of high bit depth Y, U and V words into BYTE or UINT16 texture layout.
+// Words are shifted left to 16-bit, then rounded to 8-bit for BYTE textures.
+void ConvertToShader::convRowWords(const uint16_t* srcY, const uint16_t* srcU, const uint16_t* srcV, int shift, unsigned char* dst, int width)
+{
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const __m128i zero = _mm_setzero_si128();
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? width & ~7 : 0;
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 8) {
+		__m128i valY = _mm_sll_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x)), count);
+		__m128i valU = _mm_sll_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x)), count);
+		__m128i valV = _mm_sll_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x)), count);
+		if (precision == 1) {
+			valY = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(valY, round), 8), zero);
+			valU = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(valU, round), 8), zero);
+			valV = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(valV, round), 8), zero);
+			const __m128i vu = _mm_unpacklo_epi8(valV, valU);
+			const __m128i ya = _mm_unpacklo_epi8(valY, alpha);
+			_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi16(vu, ya));
+			_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi16(vu, ya));
 		}
-		py += pitch1Y;
-		pu += pitch1UV;
-		pv += pitch1UV;
-		if (precision == 3) {
-			// Convert float buffer to half-float
-			DirectX::PackedVector::XMConvertFloatToHalfStream((DirectX::PackedVector::HALF*)halfFloatBuffer, 2, (float*)floatBuffer, 4, width << 2);
+		else {
+			const __m128i yuLo = _mm_unpacklo_epi16(valY, valU);
+			const __m128i yuHi = _mm_unpackhi_epi16(valY, valU);
+			const __m128i vaLo = _mm_unpacklo_epi16(valV, alpha);
+			const __m128i vaHi = _mm_unpackhi_epi16(valV, alpha);
+			_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi32(yuLo, vaLo));
+			_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi32(yuLo, vaLo));
+			_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi32(yuHi, vaHi));
+			_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi32(yuHi, vaHi));
+		}
+	}
 
-			// Copy half-float data back into frame
-			env->BitBlt(dst, pitch2, halfFloatBuffer, halfFloatBufferPitch, halfFloatBufferPitch, 1);
-			dst += pitch2;
+	uint16_t val[3];
+	for (int x = widthMod; x < width; ++x) {
+		val[0] = srcY[x] << shift;
+		val[1] = srcU[x] << shift;
+		val[2] = srcV[x] << shift;
+		if (precision == 1) {
+			uint8_t* out = dst + (x << 2);
+			out[0] = min(val[2] + 128, 0xFFFF) >> 8;
+			out[1] = min(val[1] + 128, 0xFFFF) >> 8;
+			out[2] = min(val[0] + 128, 0xFFFF) >> 8;
+			out[3] = 0xFF;
+		}
+		else {
+			uint16_t* outS = (uint16_t*)dst + (x << 2);
+			outS[0] = val[0];
+			outS[1] = val[1];
+			outS[2] = val[2];
+			outS[3] = 0xFFFF;
+		}
+	}
+}
+
+// Interleaves 8 pixels of Y, U, V and alpha half-float values into the texture layout.
+static inline void store_8_yuva_half(__m128i* dst, __m128i valY, __m128i valU, __m128i valV, __m128i alpha)
+{
+	const __m128i yuLo = _mm_unpacklo_epi16(valY, valU);
+	const __m128i yuHi = _mm_unpackhi_epi16(valY, valU);
+	const __m128i vaLo = _mm_unpacklo_epi16(valV, alpha);
+	const __m128i vaHi = _mm_unpackhi_epi16(valV, alpha);
+
+	_mm_storeu_si128(dst, _mm_unpacklo_epi32(yuLo, vaLo));
+	_mm_storeu_si128(dst + 1, _mm_unpackhi_epi32(yuLo, vaLo));
+	_mm_storeu_si128(dst + 2, _mm_unpacklo_epi32(yuHi, vaHi));
+	_mm_storeu_si128(dst + 3, _mm_unpackhi_epi32(yuHi, vaHi));
+}
+
+// Converts 8 high bit depth words into half-float.
+static inline __m128i load_8_words_half_f16c(const uint16_t* src, __m128 scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+	const __m128i lo = _mm_cvtps_ph(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(val, zero)), scale), 0);
+	const __m128i hi = _mm_cvtps_ph(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(val, zero)), scale), 0);
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+// Converts one row of high bit depth Y, U and V words into half-float texture layout, scaled between 0 and 1.
+void ConvertToShader::convRowWordsToHalf(const uint16_t* srcY, const uint16_t* srcU, const uint16_t* srcV, float scale, unsigned char* dst, int width)
+{
+	const int widthMod = useF16C ? width & ~7 : 0;
+	const __m128 scaleF = _mm_set1_ps(scale);
+	const __m128i alpha = _mm_set1_epi16(halfLut[255]);
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 8) {
+		store_8_yuva_half(dstLoop, load_8_words_half_f16c(srcY + x, scaleF), load_8_words_half_f16c(srcU + x, scaleF), load_8_words_half_f16c(srcV + x, scaleF), alpha);
+		dstLoop += 4;
+	}
+
+	uint16_t* outH = (uint16_t*)dst + (widthMod << 2);
+	for (int x = widthMod; x < width; ++x) {
+		outH[0] = DirectX::PackedVector::XMConvertFloatToHalf(srcY[x] * scale);
+		outH[1] = DirectX::PackedVector::XMConvertFloatToHalf(srcU[x] * scale);
+		outH[2] = DirectX::PackedVector::XMConvertFloatToHalf(srcV[x] * scale);
+		outH[3] = halfLut[255];
+		outH += 4;
+	}
+}
+
+// Converts one row of float Y, U and V samples into half-float texture layout. Values aren't clamped.
+void ConvertToShader::convRowFloatToHalf(const float* srcY, const float* srcU, const float* srcV, unsigned char* dst, int width)
+{
+	const int widthMod = useF16C ? width & ~7 : 0;
+	const __m128i alpha = _mm_set1_epi16(halfLut[255]);
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	__m128i val[3];
+	const float* src[3] = { srcY, srcU, srcV };
+	for (int x = 0; x < widthMod; x += 8) {
+		for (int i = 0; i < 3; i++) {
+			val[i] = _mm_unpacklo_epi64(_mm_cvtps_ph(_mm_loadu_ps(src[i] + x), 0), _mm_cvtps_ph(_mm_loadu_ps(src[i] + x + 4), 0));
+		}
+		store_8_yuva_half(dstLoop, val[0], val[1], val[2], alpha);
+		dstLoop += 4;
+	}
+
+	uint16_t* outH = (uint16_t*)dst + (widthMod << 2);
+	for (int x = widthMod; x < width; ++x) {
+		outH[0] = DirectX::PackedVector::XMConvertFloatToHalf(srcY[x]);
+		outH[1] = DirectX::PackedVector::XMConvertFloatToHalf(srcU[x]);
+		outH[2] = DirectX::PackedVector::XMConvertFloatToHalf(srcV[x]);
+		outH[3] = halfLut[255];
+		outH += 4;
+	}
+}
+
+// Converts RGB24 or RGB32 data into the texture layout. RGB frames are stored bottom-up, so source rows are read from the last one.
+void ConvertToShader::convRgbToShader(const byte *src, unsigned char *dst, int srcPitch, int dstPitch, int width, int height, int yStart, int yEnd) {
+	src += (height - 1 - yStart) * srcPitch;
+	dst += yStart * dstPitch;
+	for (int y = yStart; y < yEnd; ++y) {
+		(this->*convRgbRow)(src, dst, width);
+		src -= srcPitch;
+		dst += dstPitch;
+	}
+}
+
+// Converts one row of RGB24 or RGB32 pixels into BYTE, UINT16 or half-float texture layout (R, G, B).
+template <int Precision, int PixelSize>
+void ConvertToShader::convRowRgb(const byte* src, unsigned char* dst, int width)
+{
+	const byte* Val;
+	uint16_t* outH = (uint16_t*)dst;
+	for (int x = 0; x < width; ++x) {
+		Val = src + x * PixelSize;
+		if (Precision == 3) {
+			outH[0] = halfLut[Val[2]];
+			outH[1] = halfLut[Val[1]];
+			outH[2] = halfLut[Val[0]];
+			outH[3] = halfLut[255];
+			outH += 4;
 		}
 		else
-			dstLoop += dstLoopPitch;
+			convInt<Precision>(Val[2], Val[1], Val[0], dst + x * (Precision == 1 ? 4 : 8));
 	}
-	if (precision == 3) {
-		delete[] floatBuffer;
-		delete[] halfFloatBuffer;
+}
+
+// Loads 16 RGB24 or RGB32 pixels as 4 registers of B, G, R, 255 bytes.
+// RGB24 pixels are realigned from 3 loads so that nothing is read past the 48 bytes.
+template <int PixelSize>
+static inline void load_16_bgra_ssse3(const byte* src, __m128i* bgra)
+{
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	if (PixelSize == 4) {
+		for (int i = 0; i < 4; i++) {
+			bgra[i] = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (i << 4))), alpha);
+		}
+	}
+	else {
+		const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i in0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+		const __m128i in1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+		const __m128i in2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+		bgra[0] = in0;
+		bgra[1] = _mm_alignr_epi8(in1, in0, 12);
+		bgra[2] = _mm_alignr_epi8(in2, in1, 8);
+		bgra[3] = _mm_srli_si128(in2, 4);
+		for (int i = 0; i < 4; i++) {
+			bgra[i] = _mm_or_si128(_mm_shuffle_epi8(bgra[i], shuffle), alpha);
+		}
 	}
 }
 
-void ConvertToShader::convRgbToFloat(const byte *src, unsigned char *dst, int srcPitch, int dstPitch, int width, int height, IScriptEnvironment* env) {
-	unsigned char *floatBuffer;
-	unsigned char *halfFloatBuffer;
-	if (precision == 3) {
-		floatBuffer = new unsigned char[floatBufferPitch];
-		halfFloatBuffer = new unsigned char[halfFloatBufferPitch];
+// SSSE3 version of convRowRgb, 16 pixels at a time. Half-float output also requires F16C.
+// BGRA bytes are shuffled into the high byte of R, G, B, A words for UINT16, or into R, G, B, A dwords for half-float.
+template <int Precision, int PixelSize>
+void ConvertToShader::convRowRgb_ssse3(const byte* src, unsigned char* dst, int width)
+{
+	const __m128i shuffleLo = _mm_setr_epi8(-1, 2, -1, 1, -1, 0, -1, 3, -1, 6, -1, 5, -1, 4, -1, 7);
+	const __m128i shuffleHi = _mm_setr_epi8(-1, 10, -1, 9, -1, 8, -1, 11, -1, 14, -1, 13, -1, 12, -1, 15);
+	const __m128 scale = _mm_set1_ps(1.0f / 255);
+	const int widthMod = width & ~15;
+	__m128i bgra[4], half[4];
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		load_16_bgra_ssse3<PixelSize>(src + x * PixelSize, bgra);
+		for (int i = 0; i < 4; i++) {
+			if (Precision == 1)
+				_mm_storeu_si128(dstLoop++, bgra[i]);
+			else if (Precision == 2) {
+				_mm_storeu_si128(dstLoop++, _mm_shuffle_epi8(bgra[i], shuffleLo));
+				_mm_storeu_si128(dstLoop++, _mm_shuffle_epi8(bgra[i], shuffleHi));
+			}
+			else {
+				for (int j = 0; j < 4; j++) {
+					const __m128i shuffle = _mm_setr_epi8(j * 4 + 2, -1, -1, -1, j * 4 + 1, -1, -1, -1, j * 4, -1, -1, -1, j * 4 + 3, -1, -1, -1);
+					half[j] = _mm_cvtps_ph(_mm_mul_ps(_mm_cvtepi32_ps(_mm_shuffle_epi8(bgra[i], shuffle)), scale), 0);
+				}
+				_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi64(half[0], half[1]));
+				_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi64(half[2], half[3]));
+			}
+		}
 	}
+	convRowRgb<Precision, PixelSize>(src + widthMod * PixelSize, dst + widthMod * (Precision == 1 ? 4 : 8), width - widthMod);
+}
 
-	unsigned char* dstLoop = precision == 3 ? floatBuffer : dst;
-	int dstLoopPitch = precision == 3 ? floatBufferPitch : dstPitch;
+// AVX2 version of convRowRgb_ssse3 for BYTE and UINT16, 8 pixels at a time.
+// RGB24 pixels are loaded as 2 groups of 4 pixels, one per 128-bit lane, which reads 4 bytes past the 24 bytes of each group.
+template <int Precision, int PixelSize>
+void ConvertToShader::convRowRgb_avx2(const byte* src, unsigned char* dst, int width)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+	const __m256i shuffleRgb24 = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i shuffleWords = _mm256_setr_epi8(-1, 2, -1, 1, -1, 0, -1, 3, -1, 6, -1, 5, -1, 4, -1, 7, -1, 2, -1, 1, -1, 0, -1, 3, -1, 6, -1, 5, -1, 4, -1, 7);
+	const int widthMod = PixelSize == 4 ? width & ~7 : max(width - 2, 0) & ~7;
+
+	__m256i* dstLoop = reinterpret_cast<__m256i*>(dst);
+	__m256i bgra;
+	for (int x = 0; x < widthMod; x += 8) {
+		const byte* srcLoop = src + x * PixelSize;
+		if (PixelSize == 4)
+			bgra = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcLoop));
+		else {
+			bgra = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcLoop))), _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcLoop + 12)), 1);
+			bgra = _mm256_shuffle_epi8(bgra, shuffleRgb24);
+		}
+		bgra = _mm256_or_si256(bgra, alpha);
 
+		if (Precision == 1)
+			_mm256_storeu_si256(dstLoop++, bgra);
+		else {
+			// Each lane gets 2 pixels: quadwords 0, 0, 1, 1 then 2, 2, 3, 3.
+			_mm256_storeu_si256(dstLoop++, _mm256_shuffle_epi8(_mm256_permute4x64_epi64(bgra, 0x50), shuffleWords));
+			_mm256_storeu_si256(dstLoop++, _mm256_shuffle_epi8(_mm256_permute4x64_epi64(bgra, 0xFA), shuffleWords));
+		}
+	}
+	_mm256_zeroupper();
+	convRowRgb<Precision, PixelSize>(src + widthMod * PixelSize, dst + widthMod * (Precision == 1 ? 4 : 8), width - widthMod);
+}
+
+// Converts one row of 8-bit data into BYTE or UINT16 texture layout, used when SIMD is disabled.
+template <int Precision>
+void ConvertToShader::convRowInt(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	for (int x = 0; x < width; ++x) {
+		convInt<Precision>(srcY[x], srcU[x], srcV[x], dst + x * (Precision == 1 ? 4 : 8));
+	}
+}
+
+// Converts one row of Stack16 data into BYTE or UINT16 texture layout.
+template <int Precision>
+void ConvertToShader::convRowStack16(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	for (int x = 0; x < width; ++x) {
+		convStack16<Precision>(srcY[x], srcU[x], srcV[x], lsbY[x], lsbU[x], lsbV[x], dst + x * (Precision == 1 ? 4 : 8));
+	}
+}
+
+// SSE2 version of convRowStack16, 16 pixels at a time. BYTE textures round MSB up when LSB is 128 or more, saturating at 255.
+template <int Precision>
+void ConvertToShader::convRowStack16_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const int widthMod = width & ~15;
+	const byte* msb[3] = { srcY, srcU, srcV };
+	const byte* lsb[3] = { lsbY, lsbU, lsbV };
+	__m128i lo[3], hi[3];
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		if (Precision == 1) {
+			for (int i = 0; i < 3; i++) {
+				const __m128i roundUp = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lsb[i] + x)), 7), one);
+				lo[i] = _mm_adds_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(msb[i] + x)), roundUp);
+			}
+			const __m128i vuLo = _mm_unpacklo_epi8(lo[2], lo[1]);
+			const __m128i vuHi = _mm_unpackhi_epi8(lo[2], lo[1]);
+			const __m128i yaLo = _mm_unpacklo_epi8(lo[0], alpha);
+			const __m128i yaHi = _mm_unpackhi_epi8(lo[0], alpha);
+			_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi16(vuLo, yaLo));
+			_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi16(vuLo, yaLo));
+			_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi16(vuHi, yaHi));
+			_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi16(vuHi, yaHi));
+		}
+		else {
+			// Words of MSB << 8 | LSB, interleaved with alpha 0xFFFF.
+			for (int i = 0; i < 3; i++) {
+				const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(msb[i] + x));
+				const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lsb[i] + x));
+				lo[i] = _mm_unpacklo_epi8(l, m);
+				hi[i] = _mm_unpackhi_epi8(l, m);
+			}
+			for (int j = 0; j < 2; j++) {
+				const __m128i* val = j == 0 ? lo : hi;
+				const __m128i yuLo = _mm_unpacklo_epi16(val[0], val[1]);
+				const __m128i yuHi = _mm_unpackhi_epi16(val[0], val[1]);
+				const __m128i vaLo = _mm_unpacklo_epi16(val[2], alpha);
+				const __m128i vaHi = _mm_unpackhi_epi16(val[2], alpha);
+				_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi32(yuLo, vaLo));
+				_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi32(yuLo, vaLo));
+				_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi32(yuHi, vaHi));
+				_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi32(yuHi, vaHi));
+			}
+		}
+	}
+	convRowStack16<Precision>(srcY + widthMod, srcU + widthMod, srcV + widthMod, lsbY + widthMod, lsbU + widthMod, lsbV + widthMod, dst + widthMod * (Precision == 1 ? 4 : 8), width - widthMod);
+}
+
+// Converts one row of YUV or Stack16 data straight into half-float texture layout (Y, U, V, 1.0), without intermediate float buffer.
+void ConvertToShader::convRowToHalf(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	uint16_t* outH = (uint16_t*)dst;
+	if (stack16) {
+		for (int x = 0; x < width; ++x) {
+			outH[0] = DirectX::PackedVector::XMConvertFloatToHalf(float(srcY[x] << 8 | lsbY[x]) / 65535);
+			outH[1] = DirectX::PackedVector::XMConvertFloatToHalf(float(srcU[x] << 8 | lsbU[x]) / 65535);
+			outH[2] = DirectX::PackedVector::XMConvertFloatToHalf(float(srcV[x] << 8 | lsbV[x]) / 65535);
+			outH[3] = halfLut[255];
+			outH += 4;
+		}
+	}
+	else {
+		for (int x = 0; x < width; ++x) {
+			outH[0] = halfLut[srcY[x]];
+			outH[1] = halfLut[srcU[x]];
+			outH[2] = halfLut[srcV[x]];
+			outH[3] = halfLut[255];
+			outH += 4;
+		}
+	}
+}
+
+// Converts 8 samples of 8-bit or Stack16 data into half-float.
+// Only 128-bit instructions are used so that no AVX state transition occurs between legacy SSE instructions.
+static inline __m128i load_8_half_f16c(const uint8_t* msb, const uint8_t* lsb, __m128 scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i val = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(msb));
+	if (lsb != NULL)
+		val = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(lsb)), val);
+	else
+		val = _mm_unpacklo_epi8(val, zero);
+	const __m128i lo = _mm_cvtps_ph(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(val, zero)), scale), 0);
+	const __m128i hi = _mm_cvtps_ph(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(val, zero)), scale), 0);
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+// F16C version of convRowToHalf, 8 pixels at a time.
+void ConvertToShader::convRowToHalf_f16c(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	const __m128 scale = _mm_set1_ps(stack16 ? 1.0f / 65535 : 1.0f / 255);
+	const __m128i alpha = _mm_set1_epi16(halfLut[255]);
+	const int widthMod = width & ~7;
+
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 8) {
+		const __m128i valY = load_8_half_f16c(srcY + x, stack16 ? lsbY + x : NULL, scale);
+		const __m128i valU = load_8_half_f16c(srcU + x, stack16 ? lsbU + x : NULL, scale);
+		const __m128i valV = load_8_half_f16c(srcV + x, stack16 ? lsbV + x : NULL, scale);
+		store_8_yuva_half(dstLoop, valY, valU, valV, alpha);
+		dstLoop += 4;
+	}
+
+	uint16_t* outH = (uint16_t*)dst + (widthMod << 2);
+	for (int x = widthMod; x < width; ++x) {
+		if (stack16) {
+			outH[0] = _cvtss_sh(float(srcY[x] << 8 | lsbY[x]) / 65535, 0);
+			outH[1] = _cvtss_sh(float(srcU[x] << 8 | lsbU[x]) / 65535, 0);
+			outH[2] = _cvtss_sh(float(srcV[x] << 8 | lsbV[x]) / 65535, 0);
+		}
+		else {
+			outH[0] = halfLut[srcY[x]];
+			outH[1] = halfLut[srcU[x]];
+			outH[2] = halfLut[srcV[x]];
+		}
+		outH[3] = halfLut[255];
+		outH += 4;
+	}
+}
+
+// Converts the luma plane into a single-channel texture of BYTE, UINT16 or half-float samples, 1 or 2 bytes per pixel.
+void ConvertToShader::convLumaToShader(const byte *py, unsigned char *dst, int pitch1Y, int pitch2, int width, int height, int yStart, int yEnd)
+{
 	if (stack16)
 		height >>= 1;
 
-	const byte *Val, *Val2;
-	unsigned char B, G, R, B2, G2, R2;
-	src += height * srcPitch;
-	for (int y = 0; y < height; ++y) {
-		src -= srcPitch;
-		for (int x = 0; x < width; ++x) {
-			Val = vi.IsRGB32() ? &src[x << 2] : &src[x * 3];
-			B = Val[0];
-			G = Val[1];
-			R = Val[2];
-
-			if (stack16) {
-				Val2 = Val + srcPitch * height;
-				B2 = Val2[0];
-				G2 = Val2[1];
-				R2 = Val2[2];
-				convStack16(R, G, B, R2, G2, B2, dstLoop + (x << precisionShift));
+	// Stack16 LSB plane is stored below the MSB plane
+	const int lsbOffsetY = pitch1Y * height;
+
+	const byte* rowY;
+	dst += yStart * pitch2;
+	for (int y = yStart; y < yEnd; ++y) {
+		rowY = py + y * pitch1Y;
+		if (bitsPerComponent > 8)
+			convRowLumaWords(rowY, dst, width);
+		else
+			convRowLuma(rowY, stack16 ? rowY + lsbOffsetY : NULL, dst, width);
+		dst += pitch2;
+	}
+}
+
+// Converts one row of 8-bit or Stack16 luma into a single-channel texture row. Stack16 is rounded to 8-bit for BYTE textures.
+void ConvertToShader::convRowLuma(const byte* srcY, const byte* lsbY, unsigned char* dst, int width)
+{
+	if (precision == 1 && lsbY == NULL) {
+		memcpy(dst, srcY, width);
+		return;
+	}
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128 scale = _mm_set1_ps(lsbY != NULL ? 1.0f / 65535 : 1.0f / 255);
+	const int widthMod = precision == 3 ? (useF16C ? width & ~7 : 0) : (cpuLevel >= CPU_LEVEL_SSE2 ? width & ~15 : 0);
+	uint16_t* dstW = (uint16_t*)dst;
+
+	for (int x = 0; x < widthMod; x += precision == 3 ? 8 : 16) {
+		if (precision == 3)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), load_8_half_f16c(srcY + x, lsbY != NULL ? lsbY + x : NULL, scale));
+		else {
+			const __m128i msb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x));
+			const __m128i lsb = lsbY != NULL ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(lsbY + x)) : zero;
+			const __m128i lo = _mm_unpacklo_epi8(lsb, msb);
+			const __m128i hi = _mm_unpackhi_epi8(lsb, msb);
+			if (precision == 1)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(lo, round), 8), _mm_srli_epi16(_mm_adds_epu16(hi, round), 8)));
+			else {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), lo);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x + 8), hi);
 			}
-			else
-				convInt(R, G, B, dstLoop + (x << precisionShift));
 		}
-		if (precision == 3) {
-			// Convert float buffer to half-float
-			DirectX::PackedVector::XMConvertFloatToHalfStream((DirectX::PackedVector::HALF*)halfFloatBuffer, 2, (float*)floatBuffer, 4, width << 2);
+	}
 
-			// Copy half-float data back into frame
-			env->BitBlt(dst, dstPitch, halfFloatBuffer, halfFloatBufferPitch, halfFloatBufferPitch, 1);
-			dst += dstPitch;
+	int val;
+	for (int x = widthMod; x < width; ++x) {
+		val = lsbY != NULL ? srcY[x] << 8 | lsbY[x] : srcY[x] << 8;
+		if (precision == 1)
+			dst[x] = min(val + 128, 0xFFFF) >> 8;
+		else if (precision == 2)
+			dstW[x] = (uint16_t)val;
+		else
+			dstW[x] = lsbY != NULL ? DirectX::PackedVector::XMConvertFloatToHalf(float(val) / 65535) : halfLut[srcY[x]];
+	}
+}
+
+// Converts one row of high bit depth or float luma into a single-channel texture row, with the same scaling as convRowWords.
+void ConvertToShader::convRowLumaWords(const byte* src, unsigned char* dst, int width)
+{
+	const bool isFloat = bitsPerComponent == 32;
+	const float* srcF = (const float*)src;
+	const uint16_t* srcW = (const uint16_t*)src;
+	uint16_t* dstW = (uint16_t*)dst;
+
+	if (isFloat && precision == 3) {
+		// Float values aren't clamped, like convRowFloatToHalf.
+		const int widthMod = useF16C ? width & ~7 : 0;
+		for (int x = 0; x < widthMod; x += 8) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), _mm_unpacklo_epi64(_mm_cvtps_ph(_mm_loadu_ps(srcF + x), 0), _mm_cvtps_ph(_mm_loadu_ps(srcF + x + 4), 0)));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			dstW[x] = DirectX::PackedVector::XMConvertFloatToHalf(srcF[x]);
+		}
+		return;
+	}
+	if (isFloat) {
+		static thread_local ScratchBuffer wordBuffer;
+		uint16_t* words = wordBuffer.Get<uint16_t>(width + 16);
+		convRowFloatToWords(srcF, words, width);
+		srcW = words;
+	}
+
+	const int shift = isFloat ? 0 : 16 - bitsPerComponent;
+	const float scale = isFloat ? 1.0f / 65535 : 1.0f / ((1 << bitsPerComponent) - 1);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128 scaleF = _mm_set1_ps(scale);
+	const int widthMod = precision == 3 ? (useF16C ? width & ~7 : 0) : (cpuLevel >= CPU_LEVEL_SSE2 ? width & ~15 : 0);
+
+	for (int x = 0; x < widthMod; x += precision == 3 ? 8 : 16) {
+		if (precision == 3)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), load_8_words_half_f16c(srcW + x, scaleF));
+		else {
+			const __m128i lo = _mm_sll_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcW + x)), count);
+			const __m128i hi = _mm_sll_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcW + x + 8)), count);
+			if (precision == 1)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(lo, round), 8), _mm_srli_epi16(_mm_adds_epu16(hi, round), 8)));
+			else {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x), lo);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dstW + x + 8), hi);
+			}
 		}
+	}
+
+	uint16_t val;
+	for (int x = widthMod; x < width; ++x) {
+		val = srcW[x] << shift;
+		if (precision == 1)
+			dst[x] = min(val + 128, 0xFFFF) >> 8;
+		else if (precision == 2)
+			dstW[x] = val;
 		else
-			dstLoop += dstLoopPitch;
+			dstW[x] = DirectX::PackedVector::XMConvertFloatToHalf(srcW[x] * scale);
 	}
-	if (precision == 3) {
-		delete[] floatBuffer;
-		delete[] halfFloatBuffer;
+}
+
+// Converts 4:2:0 data into a single-channel luma texture followed by rows of interleaved U and V at half resolution,
+// leaving chroma upsampling to the first shader. Samples are converted the same way as with Luma.
+void ConvertToShader::convHalfChromaToShader(const byte *py, const byte *pu, const byte *pv,
+	unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd)
+{
+	const int lumaHeight = stack16 ? height >> 1 : height;
+	if (yStart < lumaHeight)
+		convLumaToShader(py, dst, pitch1Y, pitch2, width, height, yStart, min(yEnd, lumaHeight));
+
+	// Stack16 LSB planes are stored below the MSB planes
+	const int chromaWidth = width >> 1;
+	const int lsbOffsetUV = pitch1UV * (lumaHeight >> 1);
+	const int sampleSize = bitsPerComponent == 32 ? 4 : bitsPerComponent > 8 ? 2 : 1;
+
+	// Planar U and V are interleaved into a row buffer, followed by the interleaved LSB row for Stack16.
+	const int bufferPitch = (width * sampleSize + 63) & ~31;
+	static thread_local ScratchBuffer chromaBuffer;
+	byte* rowUV = semiPlanar ? NULL : chromaBuffer.Get<byte>(bufferPitch * (stack16 ? 2 : 1));
+
+	const byte* row;
+	for (int y = max(yStart, lumaHeight); y < yEnd; ++y) {
+		const int offset = (y - lumaHeight) * pitch1UV;
+		if (semiPlanar)
+			row = pu + offset;
+		else {
+			interleaveChromaRow(pu + offset, pv + offset, rowUV, chromaWidth, sampleSize);
+			if (stack16)
+				interleaveChromaRow(pu + offset + lsbOffsetUV, pv + offset + lsbOffsetUV, rowUV + bufferPitch, chromaWidth, 1);
+			row = rowUV;
+		}
+		if (bitsPerComponent > 8)
+			convRowLumaWords(row, dst + y * pitch2, width);
+		else
+			convRowLuma(row, stack16 ? row + bufferPitch : NULL, dst + y * pitch2, width);
 	}
 }
 
-void ConvertToShader::convInt(uint8_t y, uint8_t u, uint8_t v, uint8_t* out) {
+// Interleaves one row of U and V samples of 1, 2 or 4 bytes, each V sample right after its U sample.
+void ConvertToShader::interleaveChromaRow(const byte* srcU, const byte* srcV, byte* dst, int chromaWidth, int sampleSize)
+{
+	const int rowSize = chromaWidth * sampleSize;
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? rowSize & ~15 : 0;
+	__m128i lo, hi;
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x));
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x));
+		if (sampleSize == 1) {
+			lo = _mm_unpacklo_epi8(u, v);
+			hi = _mm_unpackhi_epi8(u, v);
+		}
+		else if (sampleSize == 2) {
+			lo = _mm_unpacklo_epi16(u, v);
+			hi = _mm_unpackhi_epi16(u, v);
+		}
+		else {
+			lo = _mm_unpacklo_epi32(u, v);
+			hi = _mm_unpackhi_epi32(u, v);
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1)), lo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (x << 1) + 16), hi);
+	}
+	for (int x = widthMod; x < rowSize; x += sampleSize) {
+		memcpy(dst + (x << 1), srcU + x, sampleSize);
+		memcpy(dst + (x << 1) + sampleSize, srcV + x, sampleSize);
+	}
+}
+
+// Converts the first plane of the alpha clip like luma and writes it into the alpha channel of the texture,
+// which the other converters leave opaque.
+void ConvertToShader::convAlphaToShader(const byte *pa, unsigned char *dst, int pitch1, int pitch2, int width, int height, int yStart, int yEnd)
+{
+	if (stack16)
+		height >>= 1;
+
+	// Stack16 LSB plane is stored below the MSB plane
+	const int lsbOffset = pitch1 * height;
+	static thread_local ScratchBuffer alphaBuffer;
+	unsigned char* row = alphaBuffer.Get<unsigned char>(width * 2 + 64);
+
+	const byte* rowA;
+	dst += yStart * pitch2;
+	for (int y = yStart; y < yEnd; ++y) {
+		rowA = pa + y * pitch1;
+		if (bitsPerComponent > 8)
+			convRowLumaWords(rowA, row, width);
+		else
+			convRowLuma(rowA, stack16 ? rowA + lsbOffset : NULL, row, width);
+		insertAlphaRow(row, dst, width);
+		dst += pitch2;
+	}
+}
+
+// Writes one row of single-channel samples into the alpha channel of a texture row, keeping the other 3 channels.
+void ConvertToShader::insertAlphaRow(const unsigned char* alpha, unsigned char* dst, int width)
+{
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? width & ~3 : 0;
+	const uint16_t* alphaW = (const uint16_t*)alpha;
+	uint16_t* dstW = (uint16_t*)dst;
+
 	if (precision == 1) {
+		// Each alpha byte is repeated over its pixel, then masked into the top byte.
+		const __m128i mask = _mm_set1_epi32(0xFF000000);
+		for (int x = 0; x < widthMod; x += 4) {
+			__m128i a = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(alpha + x));
+			a = _mm_unpacklo_epi8(a, a);
+			a = _mm_unpacklo_epi16(a, a);
+			__m128i* dstLoop = reinterpret_cast<__m128i*>(dst + (x << 2));
+			_mm_storeu_si128(dstLoop, _mm_or_si128(_mm_andnot_si128(mask, _mm_loadu_si128(dstLoop)), _mm_and_si128(mask, a)));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			dst[(x << 2) + 3] = alpha[x];
+		}
+	}
+	else {
+		// 4 alpha words cover 2 registers of 2 pixels each.
+		const __m128i mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+		for (int x = 0; x < widthMod; x += 4) {
+			const __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(alphaW + x));
+			const __m128i aa = _mm_unpacklo_epi16(a, a);
+			__m128i* dstLoop = reinterpret_cast<__m128i*>(dstW + (x << 2));
+			_mm_storeu_si128(dstLoop, _mm_or_si128(_mm_andnot_si128(mask, _mm_loadu_si128(dstLoop)), _mm_and_si128(mask, _mm_unpacklo_epi32(aa, aa))));
+			_mm_storeu_si128(dstLoop + 1, _mm_or_si128(_mm_andnot_si128(mask, _mm_loadu_si128(dstLoop + 1)), _mm_and_si128(mask, _mm_unpackhi_epi32(aa, aa))));
+		}
+		for (int x = widthMod; x < width; ++x) {
+			dstW[(x << 2) + 3] = alphaW[x];
+		}
+	}
+}
+
+// Packs one row of UINT16 texture pixels into A2R10G10B10, rounding each channel to 10 bits. Alpha is opaque.
+// Y, U and V keep the channels they have in X8R8G8B8: Y in bits 20-29, U in bits 10-19 and V in bits 0-9.
+void ConvertToShader::packRow10(const uint16_t* src, unsigned char* dst, int width)
+{
+	const __m128i round = _mm_set1_epi16(32);
+	const __m128i factors = _mm_set_epi16(0, 1, 1, 1 << 10, 0, 1, 1, 1 << 10);
+	const __m128i alpha = _mm_set1_epi32(0xC0000000);
+	const int widthMod = cpuLevel >= CPU_LEVEL_SSE2 ? width & ~3 : 0;
+	uint32_t* dstD = (uint32_t*)dst;
+
+	for (int x = 0; x < widthMod; x += 4) {
+		// Multiply-add gives Y << 10 | U and V for each pixel, which are then merged into one dword.
+		__m128i px[2];
+		for (int i = 0; i < 2; i++) {
+			const __m128i words = _mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (x << 2) + (i << 3))), round), 6);
+			const __m128i sums = _mm_madd_epi16(words, factors);
+			px[i] = _mm_shuffle_epi32(_mm_or_si128(_mm_slli_epi32(sums, 10), _mm_srli_epi64(sums, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dstD + x), _mm_or_si128(_mm_unpacklo_epi64(px[0], px[1]), alpha));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		const uint16_t* px = src + (x << 2);
+		dstD[x] = 0xC0000000 | (min(px[0] + 32, 0xFFFF) >> 6) << 20 | (min(px[1] + 32, 0xFFFF) >> 6) << 10 | (min(px[2] + 32, 0xFFFF) >> 6);
+	}
+}
+
+template <int Precision>
+void ConvertToShader::convInt(uint8_t y, uint8_t u, uint8_t v, uint8_t* out) {
+	if (Precision == 1) {
 		out[0] = v;
 		out[1] = u;
 		out[2] = y;
+		out[3] = 0xFF;
 	}
-	else if (precision == 2) {
+	else {
 		uint16_t *outS = (unsigned short *)out;
 		outS[0] = (uint16_t)y << 8;
 		outS[1] = (uint16_t)u << 8;
 		outS[2] = (uint16_t)v << 8;
-	}
-	else { // precision == 3
-		// Half-float, texture shaders expect data between 0 and 1
-		float rf, gf, bf;
-		rf = float(y) / 255;
-		gf = float(u) / 255;
-		bf = float(v) / 255;
-
-		float *outF = (float*)out;
-		outF[0] = rf;
-		outF[1] = gf;
-		outF[2] = bf;
+		outS[3] = 0xFF00;
 	}
 }
 
+template <int Precision>
 void ConvertToShader::convStack16(uint8_t y, uint8_t u, uint8_t v, uint8_t y2, uint8_t u2, uint8_t v2, uint8_t* out) {
-	if (precision == 1) {
+	if (Precision == 1) {
 		out[2] = y == 255 || y2 < 128 ? y : y + 1;
 		out[1] = u == 255 || u2 < 128 ? u : u + 1;
 		out[0] = v == 255 || v2 < 128 ? v : v + 1;
+		out[3] = 0xFF;
 	}
 	else {
 		// Restore 16-bit values
-		uint8_t Buffer[6];
-		Buffer[0] = y2;
-		Buffer[1] = y;
-		Buffer[2] = u2;
-		Buffer[3] = u;
-		Buffer[4] = v2;
-		Buffer[5] = v;
-		uint16_t* pBuffer = (uint16_t*)Buffer;
+		uint16_t *pOut = (uint16_t*)out;
+		pOut[0] = y << 8 | y2;
+		pOut[1] = u << 8 | u2;
+		pOut[2] = v << 8 | v2;
+		pOut[3] = 0xFFFF;
+	}
+}
 
-		if (precision == 2) {
-			uint16_t *pOut = (uint16_t*)out;
-			pOut[0] = pBuffer[0];
-			pOut[1] = pBuffer[1];
-			pOut[2] = pBuffer[2];
-		}
-		else { // precision == 3
-			// Half-float, texture shaders expect data between 0 and 1
-			float rf, gf, bf;
-			rf = float(pBuffer[0]) / 65535;
-			gf = float(pBuffer[1]) / 65535;
-			bf = float(pBuffer[2]) / 65535;
+// Interleaves 16 pixels of Y, U, V into X8R8G8B8 layout (bytes V, U, Y, 255), same as convInt with precision 1.
+void ConvertToShader::bitblt_i8_to_i8_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const int widthMod = width & ~15;
 
-			float *outF = (float*)out;
-			outF[0] = rf;
-			outF[1] = gf;
-			outF[2] = bf;
-		}
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i valY = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x));
+		const __m128i valU = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x));
+		const __m128i valV = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x));
+
+		const __m128i vuLo = _mm_unpacklo_epi8(valV, valU);
+		const __m128i vuHi = _mm_unpackhi_epi8(valV, valU);
+		const __m128i yaLo = _mm_unpacklo_epi8(valY, alpha);
+		const __m128i yaHi = _mm_unpackhi_epi8(valY, alpha);
+
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi16(vuLo, yaLo));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi16(vuLo, yaLo));
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi16(vuHi, yaHi));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi16(vuHi, yaHi));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		convInt<1>(srcY[x], srcU[x], srcV[x], dst + (x << 2));
 	}
 }
 
-// restrictions: src_stride MUST BE a multiple of 8, dst_stride MUST BE a multiple of 64 and 8x src_stride (x4 planes, x2 pixel size)
-void ConvertToShader::bitblt_i8_to_i16_sse2(const uint8_t* srcY, const uint8_t* srcU, const uint8_t* srcV, int srcPitch, uint16_t* dst, int dstPitch, int height)
+// Interleaves 16 pixels of Y, U, V into A16B16G16R16 layout (words Y<<8, U<<8, V<<8, 0xFF00), same as convInt with precision 2.
+void ConvertToShader::bitblt_i8_to_i16_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
 {
-	assert(srcPitch % 2 == 0);
-	assert(dstPitch % 16 == 0);
-	assert(dstPitch / srcPitch == 8);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const int widthMod = width & ~15;
 
-	const __m128i  zero = _mm_setzero_si128();
-	const __m128i  val_ma = _mm_set1_epi16(0);
-	const __m128i  mask_lsb = _mm_set1_epi16(0x00FF);
+	__m128i* dstLoop = reinterpret_cast<__m128i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m128i valY = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x));
+		const __m128i valU = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x));
+		const __m128i valV = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x));
 
-	uint8_t        convBuffer[8];
-	convBuffer[3] = 255;
-	convBuffer[7] = 255;
+		const __m128i yuLo = _mm_unpacklo_epi8(valY, valU);
+		const __m128i yuHi = _mm_unpackhi_epi8(valY, valU);
+		const __m128i vaLo = _mm_unpacklo_epi8(valV, alpha);
+		const __m128i vaHi = _mm_unpackhi_epi8(valV, alpha);
 
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < srcPitch; x += 2) {
-			// 1. Merge 2 pixels from 3 planes into buffer.
-			convBuffer[0] = srcY[0];
-			convBuffer[1] = srcU[0];
-			convBuffer[2] = srcV[0];
-			convBuffer[4] = srcY[1];
-			convBuffer[5] = srcU[1];
-			convBuffer[6] = srcV[1];
+		// 4 pixels of YUVA bytes each, then widened into the high byte of each word.
+		__m128i yuva = _mm_unpacklo_epi16(yuLo, vaLo);
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi8(zero, yuva));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi8(zero, yuva));
+		yuva = _mm_unpackhi_epi16(yuLo, vaLo);
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi8(zero, yuva));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi8(zero, yuva));
+		yuva = _mm_unpacklo_epi16(yuHi, vaHi);
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi8(zero, yuva));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi8(zero, yuva));
+		yuva = _mm_unpackhi_epi16(yuHi, vaHi);
+		_mm_storeu_si128(dstLoop++, _mm_unpacklo_epi8(zero, yuva));
+		_mm_storeu_si128(dstLoop++, _mm_unpackhi_epi8(zero, yuva));
+	}
+	for (int x = widthMod; x < width; ++x) {
+		convInt<2>(srcY[x], srcU[x], srcV[x], dst + (x << 3));
+	}
+}
 
-			// 2. Convert 8 bytes from UINT8 buffer into UINT16 dest
-			__m128i val = load_8_16l(convBuffer, zero);
-			val = _mm_slli_epi16(val, 8);
-			store_8_16l(dst, val, mask_lsb);
+// AVX2 version of bitblt_i8_to_i8_sse2, 32 pixels at a time.
+// Unpack instructions work within 128-bit lanes so quadwords are reordered before each unpack to keep pixels in order.
+void ConvertToShader::bitblt_i8_to_i8_avx2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	const __m256i alpha = _mm256_set1_epi8(-1);
+	const int widthMod = width & ~31;
 
-			// 3. Move to the next stride
-			srcY += 2;
-			srcU += 2;
-			srcV += 2;
-			dst += 8; // dst is uint16_t so this moves 16 bytes
-		}
+	__m256i* dstLoop = reinterpret_cast<__m256i*>(dst);
+	for (int x = 0; x < widthMod; x += 32) {
+		const __m256i valY = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcY + x)), 0xD8);
+		const __m256i valU = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcU + x)), 0xD8);
+		const __m256i valV = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcV + x)), 0xD8);
+
+		const __m256i vuLo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi8(valV, valU), 0xD8);
+		const __m256i vuHi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi8(valV, valU), 0xD8);
+		const __m256i yaLo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi8(valY, alpha), 0xD8);
+		const __m256i yaHi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi8(valY, alpha), 0xD8);
+
+		_mm256_storeu_si256(dstLoop++, _mm256_unpacklo_epi16(vuLo, yaLo));
+		_mm256_storeu_si256(dstLoop++, _mm256_unpackhi_epi16(vuLo, yaLo));
+		_mm256_storeu_si256(dstLoop++, _mm256_unpacklo_epi16(vuHi, yaHi));
+		_mm256_storeu_si256(dstLoop++, _mm256_unpackhi_epi16(vuHi, yaHi));
+	}
+	_mm256_zeroupper();
+	for (int x = widthMod; x < width; ++x) {
+		convInt<1>(srcY[x], srcU[x], srcV[x], dst + (x << 2));
 	}
 }
 
-__m128i	ConvertToShader::load_8_16l(const void *lsb_ptr, __m128i zero)
+// AVX2 version of bitblt_i8_to_i16_sse2, 32 pixels at a time.
+void ConvertToShader::bitblt_i8_to_i16_avx2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
 {
-	assert(lsb_ptr != 0);
+	const __m256i alpha = _mm256_set1_epi8(-1);
+	const int widthMod = width & ~31;
+
+	__m256i* dstLoop = reinterpret_cast<__m256i*>(dst);
+	for (int x = 0; x < widthMod; x += 32) {
+		const __m256i valY = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcY + x)), 0xD8);
+		const __m256i valU = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcU + x)), 0xD8);
+		const __m256i valV = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(srcV + x)), 0xD8);
+
+		const __m256i yuLo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi8(valY, valU), 0xD8);
+		const __m256i yuHi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi8(valY, valU), 0xD8);
+		const __m256i vaLo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi8(valV, alpha), 0xD8);
+		const __m256i vaHi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi8(valV, alpha), 0xD8);
+
+		// 8 pixels of YUVA bytes each, then widened 4 pixels at a time into the high byte of each word.
+		__m256i yuva[4];
+		yuva[0] = _mm256_unpacklo_epi16(yuLo, vaLo);
+		yuva[1] = _mm256_unpackhi_epi16(yuLo, vaLo);
+		yuva[2] = _mm256_unpacklo_epi16(yuHi, vaHi);
+		yuva[3] = _mm256_unpackhi_epi16(yuHi, vaHi);
+		for (int i = 0; i < 4; i++) {
+			_mm256_storeu_si256(dstLoop++, _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(yuva[i])), 8));
+			_mm256_storeu_si256(dstLoop++, _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(yuva[i], 1)), 8));
+		}
+	}
+	_mm256_zeroupper();
+	for (int x = widthMod; x < width; ++x) {
+		convInt<2>(srcY[x], srcU[x], srcV[x], dst + (x << 3));
+	}
+}
 
-	const __m128i  val_lsb = _mm_loadl_epi64(
-		reinterpret_cast <const __m128i *> (lsb_ptr)
-	);
-	const __m128i  val = _mm_unpacklo_epi8(val_lsb, zero);
+// AVX-512 version of bitblt_i8_to_i8_sse2, 16 pixels at a time. Each byte is zero-extended into its own pixel
+// so no lane crossing is needed, then the channels are merged into V, U, Y, 255 order.
+void ConvertToShader::bitblt_i8_to_i8_avx512(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
+{
+	const __m512i alpha = _mm512_set1_epi32(0xFF000000);
+	const int widthMod = width & ~15;
 
-	return (val);
+	__m512i* dstLoop = reinterpret_cast<__m512i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m512i valY = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x)));
+		const __m512i valU = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x)));
+		const __m512i valV = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x)));
+		const __m512i vu = _mm512_or_si512(valV, _mm512_slli_epi32(valU, 8));
+		_mm512_storeu_si512(dstLoop++, _mm512_or_si512(_mm512_or_si512(vu, _mm512_slli_epi32(valY, 16)), alpha));
+	}
+	_mm256_zeroupper();
+	for (int x = widthMod; x < width; ++x) {
+		convInt<1>(srcY[x], srcU[x], srcV[x], dst + (x << 2));
+	}
 }
 
-void ConvertToShader::store_8_16l(void *lsb_ptr, __m128i val, __m128i mask_lsb)
+// AVX-512 version of bitblt_i8_to_i16_sse2, 16 pixels at a time.
+// Pixels are first built as Y, U, V, 255 bytes like bitblt_i8_to_i8_avx512, then widened into the high byte of each word.
+void ConvertToShader::bitblt_i8_to_i16_avx512(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width)
 {
-	assert(lsb_ptr != 0);
+	const __m512i alpha = _mm512_set1_epi32(0xFF000000);
+	const int widthMod = width & ~15;
 
-	__m128i        lsb = _mm_and_si128(mask_lsb, val);
-	lsb = _mm_packus_epi16(lsb, lsb);
-	_mm_storel_epi64(reinterpret_cast <__m128i *> (lsb_ptr), lsb);
+	__m512i* dstLoop = reinterpret_cast<__m512i*>(dst);
+	for (int x = 0; x < widthMod; x += 16) {
+		const __m512i valY = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcY + x)));
+		const __m512i valU = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcU + x)));
+		const __m512i valV = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(srcV + x)));
+		const __m512i yu = _mm512_or_si512(valY, _mm512_slli_epi32(valU, 8));
+		const __m512i yuva = _mm512_or_si512(_mm512_or_si512(yu, _mm512_slli_epi32(valV, 16)), alpha);
+		_mm512_storeu_si512(dstLoop++, _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm512_castsi512_si256(yuva)), 8));
+		_mm512_storeu_si512(dstLoop++, _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(yuva, 1)), 8));
+	}
+	_mm256_zeroupper();
+	for (int x = widthMod; x < width; ++x) {
+		convInt<2>(srcY[x], srcU[x], srcV[x], dst + (x << 3));
+	}
 }
\ No newline at end of file
@@ -3,30 +3,95 @@
 #include <math.h>
 #include <limits.h>
 #include <DirectXPackedVector.h>
+#include <immintrin.h>
 #include "avisynth.h"
 #include "d3dx9.h"
+#include "ThreadPool.h"
+#include "CpuDispatch.h"
+#include "VideoFormat.h"
 #include <mutex>
+#include <vector>
 
 // Converts YV12 data into RGB data with float precision, 12-byte per pixel.
 class ConvertToShader : public GenericVideoFilter {
 public:
-	ConvertToShader(PClip _child, int _precision, bool stack16, IScriptEnvironment* env);
+	ConvertToShader(PClip _child, int _precision, bool stack16, const char* _chromaPlacement, int _threads, int _opt, const char* _format, bool _luma, bool _halfChroma, PClip _alpha, IScriptEnvironment* env);
 	~ConvertToShader();
 	PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 	const VideoInfo& __stdcall GetVideoInfo() { return viDst; }
 private:
+	// Converts one row of YUV planes into the texture layout. LSB rows are only used for Stack16.
+	typedef void (ConvertToShader::*ConvRowFunc)(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	// Converts one row of RGB24 or RGB32 pixels into the texture layout.
+	typedef void (ConvertToShader::*ConvRgbRowFunc)(const byte* src, unsigned char* dst, int width);
+
 	const int precision;
+	const bool packed10;
 	const bool stack16;
-	int precisionShift;
-	int floatBufferPitch;
-	int halfFloatBufferPitch;
-	void convYV24ToFloat(const byte *py, const byte *pu, const byte *pv,
-		unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, IScriptEnvironment* env);
-	void convRgbToFloat(const byte *src, unsigned char *dst, int srcPitch, int dstPitch, int width, int height, IScriptEnvironment* env);
+	const int threads;
+	const bool luma;
+	const bool halfChroma;
+	PClip alphaClip;
+	int cpuLevel;
+	int bitsPerComponent;
+	bool subsampledChroma;
+	bool planarRgb;
+	bool semiPlanar;
+	bool mpeg1Chroma;
+	bool useF16C;
+	uint16_t halfLut[256];
+	ConvRowFunc convRow;
+	ConvRgbRowFunc convRgbRow;
+	void convYuvToShader(const byte *py, const byte *pu, const byte *pv,
+		unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd);
+	void upsampleChromaRow(const byte* nearRow, const byte* farRow, uint16_t* tmp, unsigned char* dst, int chromaWidth);
+	void upsampleChromaRowNV12(const byte* nearRow, const byte* farRow, uint16_t* tmp, unsigned char* dstU, unsigned char* dstV, int chromaWidth);
+	void interpolateChromaRow(uint16_t* tmpRow, unsigned char* dst, int chromaWidth);
+	void upsampleChromaRow16(const byte* nearRow, const byte* farRow, int lsbOffset, int* tmp, unsigned char* dst, unsigned char* dstLsb, int chromaWidth);
+	void convHighBitDepthToShader(const byte *p0, const byte *p1, const byte *p2,
+		unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd);
+	void upsampleChromaRowWords(const uint16_t* nearRow, const uint16_t* farRow, int step, int* tmp, uint16_t* dst, int chromaWidth);
+	void convRowFloatToWords(const float* src, uint16_t* dst, int width);
+	void convRowWords(const uint16_t* srcY, const uint16_t* srcU, const uint16_t* srcV, int shift, unsigned char* dst, int width);
+	void convRowWordsToHalf(const uint16_t* srcY, const uint16_t* srcU, const uint16_t* srcV, float scale, unsigned char* dst, int width);
+	void convRowFloatToHalf(const float* srcY, const float* srcU, const float* srcV, unsigned char* dst, int width);
+	void convLumaToShader(const byte *py, unsigned char *dst, int pitch1Y, int pitch2, int width, int height, int yStart, int yEnd);
+	void convRowLuma(const byte* srcY, const byte* lsbY, unsigned char* dst, int width);
+	void convRowLumaWords(const byte* src, unsigned char* dst, int width);
+	void convHalfChromaToShader(const byte *py, const byte *pu, const byte *pv,
+		unsigned char *dst, int pitch1Y, int pitch1UV, int pitch2, int width, int height, int yStart, int yEnd);
+	void interleaveChromaRow(const byte* srcU, const byte* srcV, byte* dst, int chromaWidth, int sampleSize);
+	void convAlphaToShader(const byte *pa, unsigned char *dst, int pitch1, int pitch2, int width, int height, int yStart, int yEnd);
+	void insertAlphaRow(const unsigned char* alpha, unsigned char* dst, int width);
+	void convRows(const byte *srcY, const byte *srcU, const byte *srcV, const byte *srcA, unsigned char *dst,
+		int srcPitchY, int srcPitchUV, int srcPitchA, int dstPitch, int srcHeight, int yStart, int yEnd);
+	void packRow10(const uint16_t* src, unsigned char* dst, int width);
+	template <int PixelSize>
+	ConvRgbRowFunc selectRgbRow();
+	void convRgbToShader(const byte *src, unsigned char *dst, int srcPitch, int dstPitch, int width, int height, int yStart, int yEnd);
+	template <int Precision, int PixelSize>
+	void convRowRgb(const byte* src, unsigned char* dst, int width);
+	template <int Precision, int PixelSize>
+	void convRowRgb_ssse3(const byte* src, unsigned char* dst, int width);
+	template <int Precision, int PixelSize>
+	void convRowRgb_avx2(const byte* src, unsigned char* dst, int width);
+	template <int Precision>
 	void convInt(uint8_t y, uint8_t u, uint8_t v, uint8_t* out);
+	template <int Precision>
 	void convStack16(uint8_t y, uint8_t u, uint8_t v, uint8_t y2, uint8_t u2, uint8_t v2, uint8_t* out);
-	void bitblt_i8_to_i16_sse2(const uint8_t* srcY, const uint8_t* srcU, const uint8_t* srcV, int srcPitch, uint16_t* dst, int dstPitch, int height);
-	__m128i	load_8_16l(const void *lsb_ptr, __m128i zero);
-	void store_8_16l(void *lsb_ptr, __m128i val, __m128i mask_lsb);
+	template <int Precision>
+	void convRowInt(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	template <int Precision>
+	void convRowStack16(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	template <int Precision>
+	void convRowStack16_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void convRowToHalf(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void convRowToHalf_f16c(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i8_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i16_sse2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i8_avx2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i16_avx2(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i8_avx512(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
+	void bitblt_i8_to_i16_avx512(const byte* srcY, const byte* srcU, const byte* srcV, const byte* lsbY, const byte* lsbU, const byte* lsbV, unsigned char* dst, int width);
 	VideoInfo viDst;
 };
\ No newline at end of file
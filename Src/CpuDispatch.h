@@ -0,0 +1,30 @@
+#pragma once
+#include "avisynth.h"
+
+// Instruction set levels used to select converter kernels, from slowest to fastest.
+// Kernels that have no version for a level use the next lower level that has one.
+enum CpuLevel {
+	CPU_LEVEL_SCALAR = 0,
+	CPU_LEVEL_SSE2 = 1,
+	CPU_LEVEL_SSSE3 = 2,
+	CPU_LEVEL_AVX2 = 3,
+	CPU_LEVEL_AVX512 = 4
+};
+
+// Returns the highest level supported by the CPU. forceLevel lowers it for testing, -1 keeps the detected level.
+// A level above what the CPU supports can't be forced since those instructions would crash.
+inline int GetCpuLevel(int cpuFlags, int forceLevel)
+{
+	int level = CPU_LEVEL_SCALAR;
+	if (cpuFlags & CPUF_SSE2)
+		level = CPU_LEVEL_SSE2;
+	if (level == CPU_LEVEL_SSE2 && (cpuFlags & CPUF_SSSE3))
+		level = CPU_LEVEL_SSSE3;
+	if (level == CPU_LEVEL_SSSE3 && (cpuFlags & CPUF_AVX2))
+		level = CPU_LEVEL_AVX2;
+	if (level == CPU_LEVEL_AVX2 && (cpuFlags & CPUF_AVX512F) && (cpuFlags & CPUF_AVX512BW))
+		level = CPU_LEVEL_AVX512;
+	if (forceLevel >= 0 && forceLevel < level)
+		level = forceLevel;
+	return level;
+}
\ No newline at end of file
@@ -9,43 +9,75 @@
 // In this sample, we have 3 input textures out of 9 slots, and we run 3 shaders.
 // D = D3DPOOL_DEFAULT, S = D3DPOOL_SYSTEMMEM, R = D3DUSAGE_RENDERTARGET
 //
-// m_InputTextures
+// m_InputTextures holds one slot per input clip followed by one slot per command.
 // Index  0 1 2 3 4 5 6 7 8 9 10 11
 // CPU    D D D                   S
 // GPU    R R R             R  R  R
 //
-// m_RenderTargets contains one R texture per output resolution. The Render Target then gets 
-// copied into the next available index. Command1 outputs to RenderTarget[0] and then
-// to index 9, Command2 outputs to index 10, Command3 outputs to index 11, etc.
-// Only the final output needs to be copied from the GPU back onto the CPU, 
-// requiring a SYSTEMMEM texture.
+// Command1 renders directly into index 9, Command2 into index 10, Command3 into index 11, etc.
+// Only the final output needs to be copied from the GPU back onto the CPU, requiring a
+// SYSTEMMEM texture. It is rendered into m_RenderTargets, which holds one R texture per
+// output resolution, and read back from there. m_RenderTargets also holds the vertices of
+// each resolution. Indexes 9 and above share their GPU textures with other outputs of the
+// same size once these are no longer read by later commands, so that a command never
+// renders into a texture it reads from.
+//
+// HalfChroma clips instead use a S surface and a plain D texture for luma, and another pair
+// at half resolution for chroma, both uploaded with UpdateSurface in their own format.
+//
+// Input clips keep the textures of the last frames uploaded into them in m_Uploads, and bind
+// them again when the same frame is requested. Input clips reading the same clip share textures.
 
 #include "D3D9RenderImpl.h"
 
 D3D9RenderImpl::D3D9RenderImpl() {
-	ZeroMemory(m_InputTextures, sizeof(InputTexture) * maxTextures);
-	ZeroMemory(m_RenderTargets, sizeof(RenderTarget) * maxTextures);
-	ZeroMemory(m_Shaders, sizeof(ShaderItem) * maxTextures);
+	ZeroMemory(m_ShadowFloatValid, sizeof(m_ShadowFloatValid));
+	ZeroMemory(m_ShadowIntValid, sizeof(m_ShadowIntValid));
+	ZeroMemory(m_ShadowBoolValid, sizeof(m_ShadowBoolValid));
 }
 
 D3D9RenderImpl::~D3D9RenderImpl(void) {
-	for (int i = 0; i < maxTextures; i++) {
-		SafeRelease(m_InputTextures[0].Surface);
-		SafeRelease(m_InputTextures[0].Texture);
-		SafeRelease(m_InputTextures[0].Memory);
-	}
 }
 
-HRESULT D3D9RenderImpl::Initialize(HWND hDisplayWindow, int clipPrecision[9], int precision, int outputPrecision) {
-	HR(ApplyPrecision(precision, m_Precision, m_Format));
-	for (int i = 0; i < 9; i++) {
-		HR(ApplyPrecision(clipPrecision[i], m_ClipPrecision[i], m_ClipFormat[i]));
+HRESULT D3D9RenderImpl::Initialize(HWND hDisplayWindow, const std::vector<int>& clipPrecision, int precision, int outputPrecision, bool luma, bool halfChroma) {
+	m_Luma = luma;
+	m_HalfChroma = halfChroma;
+	m_ClipCount = (int)clipPrecision.size();
+	m_ClipPrecision.resize(m_ClipCount);
+	m_ClipFormat.resize(m_ClipCount);
+	m_ClipChromaFormat.resize(m_ClipCount);
+	m_InputTextures.resize(m_ClipCount);
+	m_Uploads.resize(m_ClipCount);
+	HR(ApplyPrecision(precision, m_Precision, m_Format, m_Luma));
+	for (int i = 0; i < m_ClipCount; i++) {
+		HR(ApplyPrecision(clipPrecision[i], m_ClipPrecision[i], m_ClipFormat[i], m_Luma || m_HalfChroma));
+		// Two-channel textures hold U in red and V in green, or V in alpha for A8L8.
+		m_ClipChromaFormat[i] = clipPrecision[i] == 1 ? D3DFMT_A8L8 : clipPrecision[i] == 2 ? D3DFMT_G16R16 : D3DFMT_G16R16F;
 	}
-	HR(ApplyPrecision(outputPrecision, m_OutputPrecision, m_OutputFormat));
+	HR(ApplyPrecision(outputPrecision, m_OutputPrecision, m_OutputFormat, m_Luma));
 
 	HR(CreateDevice(&m_pDevice, hDisplayWindow));
 
-for (int i = 0; i < 9; i++) {
+	// 10-bit and single-channel render targets are optional in Direct3D 9.
+	bool packed10 = precision == 4 || outputPrecision == 4;
+	for (int i = 0; i < m_ClipCount; i++) {
+		packed10 = packed10 || clipPrecision[i] == 4;
+	}
+	if (packed10) {
+		HR(m_pD3D9->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, D3DFMT_X8R8G8B8, D3DUSAGE_RENDERTARGET, D3DRTYPE_TEXTURE, D3DFMT_A2R10G10B10));
+	}
+	if (m_Luma) {
+		HR(m_pD3D9->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, D3DFMT_X8R8G8B8, D3DUSAGE_RENDERTARGET, D3DRTYPE_TEXTURE, m_Format));
+		HR(m_pD3D9->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, D3DFMT_X8R8G8B8, D3DUSAGE_RENDERTARGET, D3DRTYPE_TEXTURE, m_OutputFormat));
+	}
+	if (m_HalfChroma) {
+		for (int i = 0; i < m_ClipCount; i++) {
+			HR(m_pD3D9->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, D3DFMT_X8R8G8B8, 0, D3DRTYPE_TEXTURE, m_ClipFormat[i]));
+			HR(m_pD3D9->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, D3DFMT_X8R8G8B8, 0, D3DRTYPE_TEXTURE, m_ClipChromaFormat[i]));
+		}
+	}
+
+for (int i = 0; i < MaxSamplers; i++) {
 	HR(m_pDevice->SetSamplerState(i, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP));
 	HR(m_pDevice->SetSamplerState(i, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP));
 	HR(m_pDevice->SetSamplerState(i, D3DSAMP_ADDRESSW, D3DTADDRESS_CLAMP));
@@ -54,19 +86,31 @@ for (int i = 0; i < 9; i++) {
 	return S_OK;
 }
 
-// Applies the video format corresponding to specified pixel precision.
-HRESULT D3D9RenderImpl::ApplyPrecision(int precision, int &precisionOut, D3DFORMAT &formatOut) {
+// Allocates the texture slots and shaders of a command chain, following the slots of input clips.
+void D3D9RenderImpl::AllocateCommands(int count) {
+	m_InputTextures.resize(m_ClipCount + count);
+	m_Shaders.resize(count);
+}
+
+// Applies the video format corresponding to specified pixel precision. Luma textures only have one channel.
+// BYTE textures keep their alpha channel so that shaders can read data packed into it by ConvertToShader.
+HRESULT D3D9RenderImpl::ApplyPrecision(int precision, int &precisionOut, D3DFORMAT &formatOut, bool singleChannel) {
 	if (precision == 1)
-		formatOut = D3DFMT_X8R8G8B8;
+		formatOut = singleChannel ? D3DFMT_L8 : D3DFMT_A8R8G8B8;
 	else if (precision == 2)
-		formatOut = D3DFMT_A16B16G16R16;
+		formatOut = singleChannel ? D3DFMT_L16 : D3DFMT_A16B16G16R16;
 	else if (precision == 3)
-		formatOut = D3DFMT_A16B16G16R16F;
+		formatOut = singleChannel ? D3DFMT_R16F : D3DFMT_A16B16G16R16F;
+	else if (precision == 4 && !singleChannel)
+		formatOut = D3DFMT_A2R10G10B10;
 	else
 		return E_FAIL;
 
+	// Precision now holds the bytes per channel, or 1 for 10-bit pixels that take 4 bytes like BYTE.
 	if (precision == 3)
 		precisionOut = 2;
+	else if (precision == 4)
+		precisionOut = 1;
 	else
 		precisionOut = precision;
 
@@ -121,45 +165,47 @@ HRESULT D3D9RenderImpl::GetPresentParams(D3DPRESENT_PARAMETERS* params, HWND hDi
 	return S_OK;
 }
 
-HRESULT D3D9RenderImpl::SetRenderTarget(int width, int height, D3DFORMAT format, IScriptEnvironment* env)
+// Renders into surface, or into the render target texture of that size and format if surface is NULL.
+HRESULT D3D9RenderImpl::SetRenderTarget(int width, int height, D3DFORMAT format, IDirect3DSurface9* surface, IScriptEnvironment* env)
 {
-	// Skip if current render target has right dimensions.
-	if (m_pCurrentRenderTarget != NULL && m_pCurrentRenderTarget->Width == width && m_pCurrentRenderTarget->Height == height && m_pCurrentRenderTarget->Format == format)
-		return S_OK;
-
-	// Find a render target with desired proportions.
+	// Find a render target with desired proportions, starting with the current one.
 	RenderTarget* Target = NULL;
-	int i = 0;
-	while (Target == NULL && m_RenderTargets[i].Texture != NULL) {
+	if (m_pCurrentRenderTarget != NULL && m_pCurrentRenderTarget->Width == width && m_pCurrentRenderTarget->Height == height && m_pCurrentRenderTarget->Format == format)
+		Target = m_pCurrentRenderTarget;
+	for (size_t i = 0; Target == NULL && i < m_RenderTargets.size(); i++) {
 		if (m_RenderTargets[i].Width == width && m_RenderTargets[i].Height == height && m_RenderTargets[i].Format == format)
 			Target = &m_RenderTargets[i];
-		else
-			i++;
 	}
 
 	// Create it if it doesn't yet exist.
 	if (Target == NULL) {
-		// Find next unasigned texture spot.
-		i = 0;
-		while (Target == NULL && m_RenderTargets[i].Texture != NULL) {
-			if (i++ >= maxTextures)
-				env->ThrowError("ExecuteShader: Cannot output to more than 50 resolutions in a command chain");
-		}
-		Target = &m_RenderTargets[i];
+		m_RenderTargets.emplace_back();
+		Target = &m_RenderTargets.back();
 
 		Target->Width = width;
 		Target->Height = height;
 		Target->Format = format;
+		HR(SetupMatrices(Target, float(width), float(height)));
+	}
+
+	// Only outputs read back to the CPU need a texture of their own.
+	if (surface == NULL && Target->Texture == NULL) {
 		HR(m_pDevice->CreateTexture(width, height, 1, D3DUSAGE_RENDERTARGET, format, D3DPOOL_DEFAULT, &Target->Texture, NULL));
 		HR(Target->Texture->GetSurfaceLevel(0, &Target->Surface));
-		HR(m_pDevice->CreateOffscreenPlainSurface(width, height, format, D3DPOOL_SYSTEMMEM, &Target->Memory, NULL));
-
-		HR(SetupMatrices(Target, float(width), float(height)));
 	}
+	if (surface == NULL)
+		surface = Target->Surface;
+
+	// Skip if render target is already set.
+	if (Target == m_pCurrentRenderTarget && surface == m_pCurrentSurface)
+		return S_OK;
 
 	// Set render target.
+	m_pCurrentSurface = surface;
+	HR(m_pDevice->SetRenderTarget(0, surface));
+	if (Target == m_pCurrentRenderTarget)
+		return S_OK;
 	m_pCurrentRenderTarget = Target;
-	HR(m_pDevice->SetRenderTarget(0, Target->Surface));
 	return m_pDevice->SetTransform(D3DTS_PROJECTION, &Target->MatrixOrtho);
 }
 
@@ -190,7 +236,7 @@ HRESULT D3D9RenderImpl::SetupMatrices(RenderTarget* target, float width, float h
 }
 
 HRESULT D3D9RenderImpl::CreateInputTexture(int index, int clipIndex, int width, int height, bool memoryTexture, bool isSystemMemory) {
-	if (index < 0 || index >= maxTextures)
+	if (index < 0 || index >= (int)m_InputTextures.size() || (memoryTexture && !isSystemMemory && index >= m_ClipCount))
 		return E_FAIL;
 
 	InputTexture* Obj = &m_InputTextures[index];
@@ -212,65 +258,236 @@ HRESULT D3D9RenderImpl::CreateInputTexture(int index, int clipIndex, int width,
 	return S_OK;
 }
 
+// Assigns the output of a command to a render target texture of the same size and format that is no longer read,
+// or creates one. The texture is then held until command lastUse has read it.
+HRESULT D3D9RenderImpl::CreateSharedTexture(int index, int clipIndex, int width, int height, int commandIndex, int lastUse) {
+	if (index < 0 || index >= (int)m_InputTextures.size())
+		return E_FAIL;
+
+	SharedTexture* Shared = NULL;
+	for (SharedTexture& Item : m_SharedTextures) {
+		if (Item.Width == width && Item.Height == height && Item.Format == m_Format && Item.LastUse < commandIndex) {
+			Shared = &Item;
+			break;
+		}
+	}
+	if (Shared == NULL) {
+		m_SharedTextures.emplace_back();
+		Shared = &m_SharedTextures.back();
+		Shared->Width = width;
+		Shared->Height = height;
+		Shared->Format = m_Format;
+		HR(m_pDevice->CreateTexture(width, height, 1, D3DUSAGE_RENDERTARGET, m_Format, D3DPOOL_DEFAULT, &Shared->Texture, NULL));
+		HR(Shared->Texture->GetSurfaceLevel(0, &Shared->Surface));
+	}
+	Shared->LastUse = lastUse;
+
+	InputTexture* Obj = &m_InputTextures[index];
+	Obj->ClipIndex = clipIndex;
+	Obj->Width = width;
+	Obj->Height = height;
+	Obj->Texture = Shared->Texture;
+	Obj->Surface = Shared->Surface;
+	return S_OK;
+}
+
+// Creates the render target gathering the outputs of a batch of frames one below the other on the GPU, and the system
+// memory surface they are read back into. The system memory surface of the last output still reads single frames.
+HRESULT D3D9RenderImpl::CreateBatchTexture(int index, int batch) {
+	if (index < 0 || index >= (int)m_InputTextures.size() || batch < 2)
+		return E_FAIL;
+
+	InputTexture* Obj = &m_InputTextures[index];
+	HR(m_pDevice->CreateOffscreenPlainSurface(Obj->Width, Obj->Height * batch, m_OutputFormat, D3DPOOL_SYSTEMMEM, &m_BatchMemory, NULL));
+	HR(m_pDevice->CreateTexture(Obj->Width, Obj->Height * batch, 1, D3DUSAGE_RENDERTARGET, m_OutputFormat, D3DPOOL_DEFAULT, &m_BatchTexture, NULL));
+	return m_BatchTexture->GetSurfaceLevel(0, &m_BatchSurface);
+}
+
+// Returns the height of the tallest texture the device can create, which limits the frames of a batch.
+int D3D9RenderImpl::GetMaxTextureHeight() {
+	D3DCAPS9 caps;
+	if (FAILED(m_pDevice->GetDeviceCaps(&caps)))
+		return 0;
+	return (int)caps.MaxTextureHeight;
+}
+
+// Binds the textures of an input clip holding a frame uploaded earlier, and sets cached. Otherwise, binds the least
+// recently used textures of the clip, created while the ring isn't full, to upload the frame into.
+HRESULT D3D9RenderImpl::SelectUpload(int index, int frame, bool &cached) {
+	if (index < 0 || index >= m_ClipCount)
+		return E_FAIL;
+
+	InputTexture* Obj = &m_InputTextures[index];
+	std::vector<UploadEntry>& Ring = m_Uploads[index];
+	UploadEntry* Entry = NULL;
+	for (UploadEntry& Item : Ring) {
+		if (Item.Frame == frame)
+			Entry = &Item;
+	}
+	cached = Entry != NULL;
+	if (Entry == NULL && (int)Ring.size() < uploadRingSize) {
+		// The first entry takes the textures created with the clip.
+		UploadEntry Item;
+		if (Ring.empty()) {
+			Item.Texture = Obj->Texture;
+			Item.Surface = Obj->Surface;
+			Item.ChromaTexture = Obj->ChromaTexture;
+			Item.ChromaSurface = Obj->ChromaSurface;
+		}
+		else if (Obj->ChromaTexture != NULL) {
+			HR(m_pDevice->CreateTexture(Obj->Width, Obj->Height, 1, 0, m_ClipFormat[index], D3DPOOL_DEFAULT, &Item.Texture, NULL));
+			HR(Item.Texture->GetSurfaceLevel(0, &Item.Surface));
+			HR(m_pDevice->CreateTexture(Obj->Width / 2, Obj->Height / 2, 1, 0, m_ClipChromaFormat[index], D3DPOOL_DEFAULT, &Item.ChromaTexture, NULL));
+			HR(Item.ChromaTexture->GetSurfaceLevel(0, &Item.ChromaSurface));
+		}
+		else {
+			HR(m_pDevice->CreateTexture(Obj->Width, Obj->Height, 1, D3DUSAGE_RENDERTARGET, m_Format, D3DPOOL_DEFAULT, &Item.Texture, NULL));
+			HR(Item.Texture->GetSurfaceLevel(0, &Item.Surface));
+		}
+		Ring.push_back(Item);
+		Entry = &Ring.back();
+	}
+	else if (Entry == NULL) {
+		Entry = &Ring[0];
+		for (UploadEntry& Item : Ring) {
+			if (Item.LastUse < Entry->LastUse)
+				Entry = &Item;
+		}
+	}
+	if (!cached)
+		Entry->Frame = -1;
+	Entry->LastUse = ++m_UploadClock;
+
+	Obj->Texture = Entry->Texture;
+	Obj->Surface = Entry->Surface;
+	Obj->ChromaTexture = Entry->ChromaTexture;
+	Obj->ChromaSurface = Entry->ChromaSurface;
+	return S_OK;
+}
+
+// Records the frame uploaded into the textures bound to an input clip.
+void D3D9RenderImpl::CompleteUpload(int index, int frame) {
+	for (UploadEntry& Item : m_Uploads[index]) {
+		if (Item.Texture == m_InputTextures[index].Texture)
+			Item.Frame = frame;
+	}
+}
+
+// Binds the textures of an earlier input clip to an input clip reading the same frames.
+void D3D9RenderImpl::ShareInputTexture(int index, int source) {
+	InputTexture* Obj = &m_InputTextures[index];
+	const InputTexture* Source = &m_InputTextures[source];
+	Obj->Width = Source->Width;
+	Obj->Height = Source->Height;
+	Obj->Texture = Source->Texture;
+	Obj->Surface = Source->Surface;
+	Obj->ChromaTexture = Source->ChromaTexture;
+	Obj->ChromaSurface = Source->ChromaSurface;
+}
+
+// Creates the luma and chroma textures of a HalfChroma clip. Width and height are those of the luma texture.
+HRESULT D3D9RenderImpl::CreateHalfChromaTexture(int index, int clipIndex, int width, int height) {
+	if (index < 0 || index >= m_ClipCount)
+		return E_FAIL;
+
+	InputTexture* Obj = &m_InputTextures[index];
+	Obj->ClipIndex = clipIndex;
+	Obj->Width = width;
+	Obj->Height = height;
+
+	HR(m_pDevice->CreateOffscreenPlainSurface(width, height, m_ClipFormat[index], D3DPOOL_SYSTEMMEM, &Obj->Memory, NULL));
+	HR(m_pDevice->CreateTexture(width, height, 1, 0, m_ClipFormat[index], D3DPOOL_DEFAULT, &Obj->Texture, NULL));
+	HR(Obj->Texture->GetSurfaceLevel(0, &Obj->Surface));
+	HR(m_pDevice->CreateOffscreenPlainSurface(width / 2, height / 2, m_ClipChromaFormat[index], D3DPOOL_SYSTEMMEM, &Obj->ChromaMemory, NULL));
+	HR(m_pDevice->CreateTexture(width / 2, height / 2, 1, 0, m_ClipChromaFormat[index], D3DPOOL_DEFAULT, &Obj->ChromaTexture, NULL));
+	HR(Obj->ChromaTexture->GetSurfaceLevel(0, &Obj->ChromaSurface));
+	return S_OK;
+}
+
 InputTexture* D3D9RenderImpl::FindTextureByClipIndex(int clipIndex, IScriptEnvironment* env) {
-	int Result = -1;
+	InputTexture* Result = FindTextureByClipIndex(clipIndex);
+	if (Result == NULL)
+		env->ThrowError("Shader: Clip index not found");
+	return Result;
+}
+
+// Returns the latest texture written to clipIndex, or NULL if it doesn't exist yet.
+InputTexture* D3D9RenderImpl::FindTextureByClipIndex(int clipIndex) {
+	InputTexture* Result = NULL;
 	int ItemIndex;
-	for (int i = 0; i < maxTextures; i++) {
+	for (size_t i = 0; i < m_InputTextures.size(); i++) {
 		ItemIndex = m_InputTextures[i].ClipIndex;
 		if (ItemIndex == clipIndex)
-			Result = i;
+			Result = &m_InputTextures[i];
 		else if (ItemIndex == 0)
 			break;
 	}
-	if (Result == -1)
-		env->ThrowError("Shader: Clip index not found");
-	return &m_InputTextures[Result];
+	return Result;
 }
 
 void D3D9RenderImpl::ResetTextureClipIndex() {
-	for (int i = 9; i < maxTextures; i++) {
+	for (size_t i = m_ClipCount; i < m_InputTextures.size(); i++) {
 		m_InputTextures[i].ClipIndex = 0;
 	}
 }
 
-HRESULT D3D9RenderImpl::ProcessFrame(CommandStruct* cmd, int width, int height, bool isLast, IScriptEnvironment* env)
+// Starts running the commands on one or more frames.
+HRESULT D3D9RenderImpl::BeginBatch(int count)
+{
+	// A single frame is read back on its own rather than through the batch render target.
+	m_Batching = count > 1 && m_BatchSurface != NULL;
+	return m_pDevice->TestCooperativeLevel();
+}
+
+// Submits the commands of all frames of the batch, and reads back their outputs if they were batched.
+HRESULT D3D9RenderImpl::EndBatch()
 {
-	HR(m_pDevice->TestCooperativeLevel());
-	HR(SetRenderTarget(width, height, isLast ? m_OutputFormat : m_Format, env));
-	HR(CreateScene(cmd, env));
 	HR(m_pDevice->Present(NULL, NULL, NULL, NULL));
-	return CopyFromRenderTarget(9 + cmd->CommandIndex, cmd->OutputIndex, width, height);
+	if (m_Batching)
+		return m_pDevice->GetRenderTargetData(m_BatchSurface, m_BatchMemory);
+	return S_OK;
 }
 
-HRESULT D3D9RenderImpl::CreateScene(CommandStruct* cmd, IScriptEnvironment* env)
+// Intermediate outputs are rendered directly into their own texture. The last output is rendered into
+// a render target of the output format, and then copied into system memory or into the batch render target.
+HRESULT D3D9RenderImpl::ProcessFrame(const CommandPlan* plan, int batchIndex, IScriptEnvironment* env)
 {
-	HR(m_pDevice->Clear(D3DADAPTER_DEFAULT, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0));
-	HR(m_pDevice->BeginScene());
-	SCENE_HR(m_pDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1), m_pDevice);
-	SCENE_HR(m_pDevice->SetPixelShader(m_Shaders[cmd->CommandIndex].Shader), m_pDevice);
-	SCENE_HR(m_pDevice->SetStreamSource(0, m_pCurrentRenderTarget->VertexBuffer, 0, sizeof(VERTEX)), m_pDevice);
+	// Bind inputs first so that the previous command's inputs are released before rendering into one of them.
+	HR(SetSamplers(plan));
+	HR(SetRenderTarget(plan->OutputWidth, plan->OutputHeight, plan->IsLast ? m_OutputFormat : m_Format, plan->IsLast ? NULL : (IDirect3DSurface9*)plan->Output->Surface, env));
+	HR(CreateScene(plan));
+	if (plan->IsLast)
+		return CopyFromRenderTarget(plan->Output, batchIndex);
+	return S_OK;
+}
 
-	// Set input clips.
-	InputTexture* Input;
-	for (int i = 0; i < 9; i++) {
-		if (cmd->ClipIndex[i] > 0) {
-			Input = FindTextureByClipIndex(cmd->ClipIndex[i], env);
-			if (Input != NULL) {
-				SCENE_HR(m_pDevice->SetTexture(i, Input->Texture), m_pDevice);
-			}
-			else
-				env->ThrowError("Shader: Invalid clip index.");
+// Binds the textures of a command to samplers, and unbinds the other samplers. Samplers that don't change are skipped.
+HRESULT D3D9RenderImpl::SetSamplers(const CommandPlan* plan)
+{
+	IDirect3DTexture9* Texture;
+	for (int i = 0; i < MaxSamplers; i++) {
+		const SamplerBinding* Binding = &plan->Samplers[i];
+		Texture = Binding->Input == NULL ? NULL : Binding->Chroma ? Binding->Input->ChromaTexture : Binding->Input->Texture;
+		if (m_BoundTextures[i] != Texture) {
+			HR(m_pDevice->SetTexture(i, Texture));
+			m_BoundTextures[i] = Texture;
 		}
 	}
+	return S_OK;
+}
 
+HRESULT D3D9RenderImpl::CreateScene(const CommandPlan* plan)
+{
+	HR(m_pDevice->Clear(D3DADAPTER_DEFAULT, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0));
+	HR(m_pDevice->BeginScene());
+	SCENE_HR(m_pDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_TEX1), m_pDevice);
+	SCENE_HR(m_pDevice->SetPixelShader(m_Shaders[plan->CommandIndex].Shader), m_pDevice);
+	SCENE_HR(m_pDevice->SetStreamSource(0, m_pCurrentRenderTarget->VertexBuffer, 0, sizeof(VERTEX)), m_pDevice);
 	SCENE_HR(m_pDevice->DrawPrimitive(D3DPT_TRIANGLEFAN, 0, 2), m_pDevice);
 	return m_pDevice->EndScene();
 }
 
-HRESULT D3D9RenderImpl::CopyBuffer(InputTexture* srcSurface, int commandIndex, int outputIndex, IScriptEnvironment* env) {
-	InputTexture* dstSurface = &m_InputTextures[9 + commandIndex];
-	dstSurface->ClipIndex = outputIndex;
-
+HRESULT D3D9RenderImpl::CopyBuffer(InputTexture* srcSurface, InputTexture* dstSurface) {
 	//HR(m_pDevice->ColorFill(dstSurface->Surface, NULL, D3DCOLOR_ARGB(0xFF, 0, 0, 0)));
 	HR(m_pDevice->StretchRect(srcSurface->Surface, NULL, dstSurface->Surface, NULL, D3DTEXF_POINT));
 	return S_OK;
@@ -278,15 +495,17 @@ HRESULT D3D9RenderImpl::CopyBuffer(InputTexture* srcSurface, int commandIndex, i
 
 HRESULT D3D9RenderImpl::CopyAviSynthToBuffer(const byte* src, int srcPitch, int index, int width, int height, IScriptEnvironment* env) {
 	// Copies source frame into main surface buffer, or into additional input textures
-	CComPtr<IDirect3DSurface9> destSurface = m_InputTextures[index].Memory;
-	if (index < 0 || index >= maxTextures)
+	if (index < 0 || index >= m_ClipCount)
 		return E_FAIL;
+	CComPtr<IDirect3DSurface9> destSurface = m_InputTextures[index].Memory;
+	if (m_InputTextures[index].ChromaTexture != NULL)
+		return CopyHalfChromaToBuffer(src, srcPitch, index, width, height, env);
 
 	D3DLOCKED_RECT d3drect;
 	HR(destSurface->LockRect(&d3drect, NULL, 0));
 	BYTE* pict = (BYTE*)d3drect.pBits;
 
-	env->BitBlt(pict, d3drect.Pitch, src, srcPitch, width * m_ClipPrecision[index] * 4, height);
+	env->BitBlt(pict, d3drect.Pitch, src, srcPitch, width * m_ClipPrecision[index] * (m_Luma ? 1 : 4), height);
 
 	HR(destSurface->UnlockRect());
 
@@ -295,36 +514,44 @@ HRESULT D3D9RenderImpl::CopyAviSynthToBuffer(const byte* src, int srcPitch, int
 	return (m_pDevice->StretchRect(m_InputTextures[index].Memory, NULL, m_InputTextures[index].Surface, NULL, D3DTEXF_POINT));
 }
 
-HRESULT D3D9RenderImpl::CopyFromRenderTarget(int dstIndex, int outputIndex, int width, int height)
-{
-	if (dstIndex < 0 || dstIndex >= maxTextures)
-		return E_FAIL;
+// Uploads the luma rows of a HalfChroma frame and the rows of interleaved U and V below them, without format conversion.
+HRESULT D3D9RenderImpl::CopyHalfChromaToBuffer(const byte* src, int srcPitch, int index, int width, int height, IScriptEnvironment* env) {
+	InputTexture* Obj = &m_InputTextures[index];
+	const int rowSize = width * m_ClipPrecision[index];
 
-	InputTexture* Output = &m_InputTextures[dstIndex];
-	CComPtr<IDirect3DSurface9> pReadSurfaceGpu;
-	HR(m_pDevice->GetRenderTarget(0, &pReadSurfaceGpu));
-	Output->ClipIndex = outputIndex;
-	if (Output->Memory == NULL) {
-		//HR(m_pDevice->ColorFill(Output->Surface, NULL, D3DCOLOR_ARGB(0xFF, 0, 0, 0)));
-		HR(m_pDevice->StretchRect(pReadSurfaceGpu, NULL, Output->Surface, NULL, D3DTEXF_POINT));
-	}
-	else {
-		// If reading last command, copy it back to CPU directly
-		HR(m_pDevice->GetRenderTargetData(pReadSurfaceGpu, Output->Memory));
-	}
-	return S_OK;
+	D3DLOCKED_RECT d3drect;
+	HR(Obj->Memory->LockRect(&d3drect, NULL, 0));
+	env->BitBlt((BYTE*)d3drect.pBits, d3drect.Pitch, src, srcPitch, rowSize, height);
+	HR(Obj->Memory->UnlockRect());
+	HR(m_pDevice->UpdateSurface(Obj->Memory, NULL, Obj->Surface, NULL));
+
+	HR(Obj->ChromaMemory->LockRect(&d3drect, NULL, 0));
+	env->BitBlt((BYTE*)d3drect.pBits, d3drect.Pitch, src + height * srcPitch, srcPitch, rowSize, height / 2);
+	HR(Obj->ChromaMemory->UnlockRect());
+	return m_pDevice->UpdateSurface(Obj->ChromaMemory, NULL, Obj->ChromaSurface, NULL);
+}
+
+// Copies the last output back to CPU directly, or below the outputs of the previous frames of the batch.
+HRESULT D3D9RenderImpl::CopyFromRenderTarget(InputTexture* Output, int batchIndex)
+{
+	if (!m_Batching)
+		return m_pDevice->GetRenderTargetData(m_pCurrentSurface, Output->Memory);
+	RECT Rect = { 0, batchIndex * Output->Height, Output->Width, (batchIndex + 1) * Output->Height };
+	return m_pDevice->StretchRect(m_pCurrentSurface, NULL, m_BatchSurface, &Rect, D3DTEXF_POINT);
 }
 
-HRESULT D3D9RenderImpl::CopyBufferToAviSynth(int commandIndex, byte* dst, int dstPitch, IScriptEnvironment* env) {
-	InputTexture* ReadSurface = &m_InputTextures[9 + commandIndex];
+// Copies the output of a frame of the batch into an AviSynth frame.
+HRESULT D3D9RenderImpl::CopyBufferToAviSynth(int commandIndex, int batchIndex, byte* dst, int dstPitch, IScriptEnvironment* env) {
+	InputTexture* ReadSurface = &m_InputTextures[m_ClipCount + commandIndex];
+	IDirect3DSurface9* Memory = m_Batching ? m_BatchMemory : ReadSurface->Memory;
 
 	D3DLOCKED_RECT srcRect;
-	HR(ReadSurface->Memory->LockRect(&srcRect, NULL, D3DLOCK_NO_DIRTY_UPDATE | D3DLOCK_NOSYSLOCK | D3DLOCK_READONLY));
-	BYTE* srcPict = (BYTE*)srcRect.pBits;
+	HR(Memory->LockRect(&srcRect, NULL, D3DLOCK_NO_DIRTY_UPDATE | D3DLOCK_NOSYSLOCK | D3DLOCK_READONLY));
+	BYTE* srcPict = (BYTE*)srcRect.pBits + batchIndex * ReadSurface->Height * srcRect.Pitch;
 
-	env->BitBlt(dst, dstPitch, srcPict, srcRect.Pitch, ReadSurface->Width * m_OutputPrecision * 4, ReadSurface->Height);
+	env->BitBlt(dst, dstPitch, srcPict, srcRect.Pitch, ReadSurface->Width * m_OutputPrecision * (m_Luma ? 1 : 4), ReadSurface->Height);
 
-	return ReadSurface->Memory->UnlockRect();
+	return Memory->UnlockRect();
 }
 
 HRESULT D3D9RenderImpl::InitPixelShader(CommandStruct* cmd, IScriptEnvironment* env) {
@@ -353,12 +580,33 @@ HRESULT D3D9RenderImpl::InitPixelShader(CommandStruct* cmd, IScriptEnvironment*
 	}
 
 	HR(m_pDevice->CreatePixelShader(CodeBuffer, &Shader->Shader));
+	Shader->Code.assign(CodeBuffer, CodeBuffer + D3DXGetShaderSize(CodeBuffer) / sizeof(DWORD));
 
 	if (ShaderBuf != NULL)
 		free(ShaderBuf);
 	return S_OK;
 }
 
+// Replaces the shader of the second command with a shader running both commands, reading the output of the first
+// command from a register instead of its texture. Fails if the shaders can't be linked.
+HRESULT D3D9RenderImpl::LinkPixelShaders(int firstCommand, int secondCommand, ShaderLinkInfo* info) {
+	ShaderItem* First = &m_Shaders[firstCommand];
+	ShaderItem* Second = &m_Shaders[secondCommand];
+	std::vector<DWORD> Code;
+	// Half-float textures keep values out of the 0 to 1 range.
+	info->Saturate = m_Format != D3DFMT_A16B16G16R16F;
+	if (!::LinkPixelShaders(First->Code, Second->Code, info, Code))
+		return E_FAIL;
+
+	CComPtr<IDirect3DPixelShader9> Shader;
+	HR(m_pDevice->CreatePixelShader(Code.data(), &Shader));
+	Second->Shader = Shader;
+	Second->Code = std::move(Code);
+	First->Shader.Release();
+	First->Code.clear();
+	return S_OK;
+}
+
 unsigned char* D3D9RenderImpl::ReadBinaryFile(const char* filePath) {
 	FILE *fl = fopen(filePath, "rb");
 	if (fl == NULL) {
@@ -407,15 +655,62 @@ HRESULT D3D9RenderImpl::SetDefaults(LPD3DXCONSTANTTABLE table) {
 	return table->SetDefaults(m_pDevice);
 }
 
-HRESULT D3D9RenderImpl::SetPixelShaderConstant(int index, const ParamStruct* param) {
-	if (param->Type == ParamType::Float) {
-		HR(m_pDevice->SetPixelShaderConstantF(index, (float*)param->Values, param->Count));
+// Uploads shader constants, unless the registers already hold the same values from a previous command or frame.
+HRESULT D3D9RenderImpl::SetPixelShaderConstant(const ShaderConstant* constant) {
+	const int Start = constant->Register;
+	const int Count = constant->Count;
+	const float* Values = constant->Values.data();
+	if (constant->Type == ParamType::Float) {
+		if (IsConstantCached(m_ShadowFloat, m_ShadowFloatValid, maxFloatConstants, 4, Start, Count, Values)) {
+			m_ConstantUploadsSkipped++;
+			return S_OK;
+		}
+		HR(m_pDevice->SetPixelShaderConstantF(Start, Values, Count));
+		CacheConstant(m_ShadowFloat, m_ShadowFloatValid, maxFloatConstants, 4, Start, Count, Values);
 	}
-	else if (param->Type == ParamType::Int) {
-		HR(m_pDevice->SetPixelShaderConstantI(index, (int*)param->Values, param->Count));
+	else if (constant->Type == ParamType::Int) {
+		if (IsConstantCached(m_ShadowInt, m_ShadowIntValid, maxIntConstants, 4, Start, Count, Values)) {
+			m_ConstantUploadsSkipped++;
+			return S_OK;
+		}
+		HR(m_pDevice->SetPixelShaderConstantI(Start, (const int*)Values, Count));
+		CacheConstant(m_ShadowInt, m_ShadowIntValid, maxIntConstants, 4, Start, Count, Values);
 	}
-	else if (param->Type == ParamType::Bool) {
-		HR(m_pDevice->SetPixelShaderConstantB(index, (const BOOL*)param->Values, param->Count));
+	else if (constant->Type == ParamType::Bool) {
+		if (IsConstantCached(m_ShadowBool, m_ShadowBoolValid, maxBoolConstants, 1, Start, Count, Values)) {
+			m_ConstantUploadsSkipped++;
+			return S_OK;
+		}
+		HR(m_pDevice->SetPixelShaderConstantB(Start, (const BOOL*)Values, Count));
+		CacheConstant(m_ShadowBool, m_ShadowBoolValid, maxBoolConstants, 1, Start, Count, Values);
 	}
+	m_ConstantUploads++;
 	return S_OK;
 }
+
+// Returns whether registers start to start + count already hold values. RegisterSize is the number of DWORDs per register.
+bool D3D9RenderImpl::IsConstantCached(const DWORD* shadow, const bool* valid, int maxRegisters, int registerSize, int start, int count, const float* values) {
+	if (start < 0 || start + count > maxRegisters)
+		return false;
+	for (int i = start; i < start + count; i++) {
+		if (!valid[i])
+			return false;
+	}
+	return memcmp(shadow + start * registerSize, values, count * registerSize * sizeof(DWORD)) == 0;
+}
+
+// Remembers values uploaded into registers start to start + count. Registers out of range are never cached.
+void D3D9RenderImpl::CacheConstant(DWORD* shadow, bool* valid, int maxRegisters, int registerSize, int start, int count, const float* values) {
+	if (start < 0 || start + count > maxRegisters)
+		return;
+	memcpy(shadow + start * registerSize, values, count * registerSize * sizeof(DWORD));
+	for (int i = start; i < start + count; i++) {
+		valid[i] = true;
+	}
+}
+
+// Gets how many constant uploads were sent to the device, and how many were skipped because registers already held the values.
+void D3D9RenderImpl::GetConstantUploads(__int64 &uploaded, __int64 &skipped) {
+	uploaded = m_ConstantUploads;
+	skipped = m_ConstantUploadsSkipped;
+}
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include "avisynth.h"
 #include <windows.h>
 #include "CommandStruct.h"
+#include "ShaderLinker.h"
+#include <vector>
+#include <deque>
 
 struct InputTexture {
 	int ClipIndex;
@@ -13,12 +16,15 @@ struct InputTexture {
 	CComPtr<IDirect3DSurface9> Memory;
 	CComPtr<IDirect3DTexture9> Texture;
 	CComPtr<IDirect3DSurface9> Surface;
+	// Half-resolution U and V of a HalfChroma clip, bound to the sampler following the luma texture.
+	CComPtr<IDirect3DSurface9> ChromaMemory;
+	CComPtr<IDirect3DTexture9> ChromaTexture;
+	CComPtr<IDirect3DSurface9> ChromaSurface;
 };
 
 struct RenderTarget {
 	int Width, Height;
 	D3DFORMAT Format;
-	CComPtr<IDirect3DSurface9> Memory;
 	CComPtr<IDirect3DTexture9> Texture;
 	CComPtr<IDirect3DSurface9> Surface;
 	
@@ -26,9 +32,55 @@ struct RenderTarget {
 	CComPtr<IDirect3DVertexBuffer9> VertexBuffer;
 };
 
+// Shader constants of a command, with values owned by the execution plan.
+struct ShaderConstant {
+	int Register;
+	ParamType Type;
+	int Count;		// The quantity of Float4 vectors, or of Bool values.
+	std::vector<float> Values;
+};
+
+// Texture bound to a sampler. Input clips change textures between frames, so the texture is read when executing.
+struct SamplerBinding {
+	InputTexture* Input;	// NULL unbinds the sampler.
+	bool Chroma;			// Binds the chroma of a HalfChroma clip.
+};
+
+// A command of the chain resolved once when ExecuteShader is created, so that executing it only binds, draws and copies.
+struct CommandPlan {
+	int CommandIndex;
+	bool HasShader;
+	bool IsLast;
+	int OutputWidth, OutputHeight;
+	SamplerBinding Samplers[MaxSamplers];	// Includes the chroma of HalfChroma clips.
+	InputTexture* Source;			// Texture copied into Output by commands without shader.
+	InputTexture* Output;
+	std::vector<ShaderConstant> Constants;
+};
+
+// Render target texture shared by intermediate outputs with disjoint lifetimes.
+struct SharedTexture {
+	int Width, Height;
+	D3DFORMAT Format;
+	int LastUse;	// Last command reading the output currently held.
+	CComPtr<IDirect3DTexture9> Texture;
+	CComPtr<IDirect3DSurface9> Surface;
+};
+
+// Textures of an input clip holding a frame uploaded earlier, kept to skip uploading it again.
+struct UploadEntry {
+	int Frame;			// -1 until a frame is uploaded.
+	__int64 LastUse;
+	CComPtr<IDirect3DTexture9> Texture;
+	CComPtr<IDirect3DSurface9> Surface;
+	CComPtr<IDirect3DTexture9> ChromaTexture;
+	CComPtr<IDirect3DSurface9> ChromaSurface;
+};
+
 struct ShaderItem {
 	CComPtr<IDirect3DPixelShader9> Shader;
 	CComPtr<ID3DXConstantTable> ConstantTable;
+	std::vector<DWORD> Code;	// Kept to link the shader with the shader of the next command.
 };
 
 class D3D9RenderImpl
@@ -37,46 +89,91 @@ public:
 	D3D9RenderImpl();
 	~D3D9RenderImpl();
 
-	HRESULT Initialize(HWND hDisplayWindow, int clipPrecision[9], int precision, int outputPrecision);
+	HRESULT Initialize(HWND hDisplayWindow, const std::vector<int>& clipPrecision, int precision, int outputPrecision, bool luma, bool halfChroma);
+	void AllocateCommands(int count);
 	HRESULT CreateInputTexture(int index, int clipIndex, int width, int height, bool memoryTexture, bool isSystemMemory);
-	HRESULT CopyBuffer(InputTexture* srcSurface, int commandIndex, int outputIndex, IScriptEnvironment* env);
+	HRESULT CreateSharedTexture(int index, int clipIndex, int width, int height, int commandIndex, int lastUse);
+	HRESULT CreateHalfChromaTexture(int index, int clipIndex, int width, int height);
+	HRESULT CreateBatchTexture(int index, int batch);
+	int GetMaxTextureHeight();
+	HRESULT SelectUpload(int index, int frame, bool &cached);
+	void CompleteUpload(int index, int frame);
+	void ShareInputTexture(int index, int source);
+	HRESULT CopyBuffer(InputTexture* srcSurface, InputTexture* dstSurface);
 	HRESULT CopyAviSynthToBuffer(const byte* src, int srcPitch, int index, int width, int height, IScriptEnvironment* env);
-	HRESULT CopyBufferToAviSynth(int commandIndex, byte* dst, int dstPitch, IScriptEnvironment* env);
-	HRESULT ProcessFrame(CommandStruct* cmd, int width, int height, bool isLast, IScriptEnvironment* env);
+	HRESULT CopyHalfChromaToBuffer(const byte* src, int srcPitch, int index, int width, int height, IScriptEnvironment* env);
+	HRESULT CopyBufferToAviSynth(int commandIndex, int batchIndex, byte* dst, int dstPitch, IScriptEnvironment* env);
+	HRESULT BeginBatch(int count);
+	HRESULT EndBatch();
+	HRESULT ProcessFrame(const CommandPlan* plan, int batchIndex, IScriptEnvironment* env);
 	InputTexture* FindTextureByClipIndex(int clipIndex, IScriptEnvironment* env);
+	InputTexture* FindTextureByClipIndex(int clipIndex);
 	void ResetTextureClipIndex();
 
 	HRESULT InitPixelShader(CommandStruct* cmd, IScriptEnvironment* env);
+	HRESULT LinkPixelShaders(int firstCommand, int secondCommand, ShaderLinkInfo* info);
 	HRESULT SetDefaults(LPD3DXCONSTANTTABLE table);
-	HRESULT SetPixelShaderConstant(int index, const ParamStruct* param);
-	static const int maxTextures = 50;
-	InputTexture m_InputTextures[maxTextures];
-	ShaderItem m_Shaders[maxTextures];
+	HRESULT SetPixelShaderConstant(const ShaderConstant* constant);
+	void GetConstantUploads(__int64 &uploaded, __int64 &skipped);
+	std::vector<InputTexture> m_InputTextures;
+	std::vector<ShaderItem> m_Shaders;
 
 private:
-	HRESULT ApplyPrecision(int precision, int &precisionOut, D3DFORMAT &formatOut);
+	HRESULT ApplyPrecision(int precision, int &precisionOut, D3DFORMAT &formatOut, bool singleChannel);
 	unsigned char* ReadBinaryFile(const char* filePath);
 	void GetDefaultPath(char* outPath, int maxSize, const char* filePath);
 	static void StaticFunction() {}; // needed by GetDefaultPath
 	HRESULT CreateDevice(IDirect3DDevice9Ex** device, HWND hDisplayWindow);
 	HRESULT SetupMatrices(RenderTarget* target, float width, float height);
-	HRESULT CreateScene(CommandStruct* cmd, IScriptEnvironment* env);
-	HRESULT CopyFromRenderTarget(int dstIndex, int outputIndex, int width, int height);
-	HRESULT SetRenderTarget(int width, int height, D3DFORMAT format, IScriptEnvironment* env);
+	HRESULT SetSamplers(const CommandPlan* plan);
+	HRESULT CreateScene(const CommandPlan* plan);
+	HRESULT CopyFromRenderTarget(InputTexture* output, int batchIndex);
+	HRESULT SetRenderTarget(int width, int height, D3DFORMAT format, IDirect3DSurface9* surface, IScriptEnvironment* env);
 	HRESULT GetPresentParams(D3DPRESENT_PARAMETERS* params, HWND hDisplayWindow);
+	bool IsConstantCached(const DWORD* shadow, const bool* valid, int maxRegisters, int registerSize, int start, int count, const float* values);
+	void CacheConstant(DWORD* shadow, bool* valid, int maxRegisters, int registerSize, int start, int count, const float* values);
 
 	CComPtr<IDirect3D9Ex>           m_pD3D9;
 	CComPtr<IDirect3DDevice9Ex>     m_pDevice;
-	RenderTarget m_RenderTargets[maxTextures];
+	std::deque<RenderTarget> m_RenderTargets;	// Deque keeps m_pCurrentRenderTarget valid as targets are added.
 	RenderTarget* m_pCurrentRenderTarget = NULL;
+	IDirect3DSurface9* m_pCurrentSurface = NULL;
+	IDirect3DTexture9* m_BoundTextures[MaxSamplers] = {};
+	std::vector<SharedTexture> m_SharedTextures;
+	// Textures of the last frames uploaded into each input clip, including the bound ones.
+	static const int uploadRingSize = 2;
+	std::vector<std::vector<UploadEntry>> m_Uploads;
+	__int64 m_UploadClock = 0;
+	// Outputs of a batch of frames one below the other, read back at once. NULL when frames aren't batched.
+	CComPtr<IDirect3DTexture9> m_BatchTexture;
+	CComPtr<IDirect3DSurface9> m_BatchSurface;
+	CComPtr<IDirect3DSurface9> m_BatchMemory;
+	bool m_Batching = false;	// Whether the current batch has several frames, gathered into m_BatchSurface.
 
+	bool m_Luma;
+	bool m_HalfChroma;
 	int m_Precision;
-	int m_ClipPrecision[9];
+	int m_ClipCount;
+	std::vector<int> m_ClipPrecision;
 	int m_OutputPrecision;
 	D3DFORMAT m_Format;
-	D3DFORMAT m_ClipFormat[9];
+	std::vector<D3DFORMAT> m_ClipFormat;
+	std::vector<D3DFORMAT> m_ClipChromaFormat;
 	D3DFORMAT m_OutputFormat;
 	D3DDISPLAYMODE m_displayMode;
 	D3DPRESENT_PARAMETERS m_presentParams;
 	IScriptEnvironment* m_env;
+
+	// Last values uploaded into the pixel shader constant registers, which keep their values across shaders and frames.
+	static const int maxFloatConstants = 224;
+	static const int maxIntConstants = 16;
+	static const int maxBoolConstants = 16;
+	DWORD m_ShadowFloat[maxFloatConstants * 4];
+	DWORD m_ShadowInt[maxIntConstants * 4];
+	DWORD m_ShadowBool[maxBoolConstants];
+	bool m_ShadowFloatValid[maxFloatConstants];
+	bool m_ShadowIntValid[maxIntConstants];
+	bool m_ShadowBoolValid[maxBoolConstants];
+	__int64 m_ConstantUploads = 0;
+	__int64 m_ConstantUploadsSkipped = 0;
 };
\ No newline at end of file
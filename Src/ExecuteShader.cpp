@@ -1,25 +1,23 @@
 #include "ExecuteShader.h"
 // http://gamedev.stackexchange.com/questions/13435/loading-and-using-an-hlsl-shader
 
-ExecuteShader::ExecuteShader(PClip _child, PClip _clip1, PClip _clip2, PClip _clip3, PClip _clip4, PClip _clip5, PClip _clip6, PClip _clip7, PClip _clip8, PClip _clip9, int _clipPrecision[9], int _precision, int _outputPrecision, IScriptEnvironment* env) :
-	GenericVideoFilter(_child), m_Precision(_precision), m_OutputPrecision(_outputPrecision) {
-
-	memcpy(m_ClipPrecision, _clipPrecision, sizeof(int) * 9);
-	m_clips[0] = _clip1;
-	m_clips[1] = _clip2;
-	m_clips[2] = _clip3;
-	m_clips[3] = _clip4;
-	m_clips[4] = _clip5;
-	m_clips[5] = _clip6;
-	m_clips[6] = _clip7;
-	m_clips[7] = _clip8;
-	m_clips[8] = _clip9;
+ExecuteShader::ExecuteShader(PClip _child, const std::vector<PClip>& _clips, const std::vector<int>& _clipPrecision, int _precision, int _outputPrecision, bool _luma, bool _halfChroma, int _batch, IScriptEnvironment* env) :
+	GenericVideoFilter(_child), m_Precision(_precision), m_OutputPrecision(_outputPrecision), m_Luma(_luma), m_HalfChroma(_halfChroma), m_Batch(_batch),
+	m_clips(_clips), m_ClipPrecision(_clipPrecision) {
 
 	// Validate parameters
 	if (!vi.IsY8())
 		env->ThrowError("ExecuteShader: Source must be a command chain");
-	if (m_Precision < 1 || m_Precision > 3)
-		env->ThrowError("ExecuteShader: Precision must be 1, 2 or 3");
+	if (m_clips.size() != m_ClipPrecision.size())
+		env->ThrowError("ExecuteShader: Each clip must have a precision");
+	if (m_Precision < 1 || m_Precision > 4)
+		env->ThrowError("ExecuteShader: Precision must be 1, 2, 3 or 4");
+	if (m_OutputPrecision < 1 || m_OutputPrecision > 4)
+		env->ThrowError("ExecuteShader: OutputPrecision must be 1, 2, 3 or 4");
+	if (m_Luma && m_HalfChroma)
+		env->ThrowError("ExecuteShader: Luma and HalfChroma can't both be used");
+	if (m_Batch < 1)
+		env->ThrowError("ExecuteShader: Batch must be 1 or more");
 
 	// Initialize
 	dummyHWND = CreateWindowA("STATIC", "dummy", 0, 0, 0, 100, 100, NULL, NULL, NULL, NULL);
@@ -32,73 +30,141 @@ ExecuteShader::ExecuteShader(PClip _child, PClip _clip1, PClip _clip2, PClip _cl
 }
 
 ExecuteShader::~ExecuteShader() {
+	__int64 Uploaded, Skipped;
+	render->GetConstantUploads(Uploaded, Skipped);
+	DebugReport("ExecuteShader: %lld constant uploads, %lld skipped", Uploaded, Skipped);
+	DebugReport("ExecuteShader: %lld input frames uploaded, %lld reused, %lld shared with an identical clip", m_UploadMisses, m_UploadHits, m_UploadsShared);
+
 	delete render;
 	DestroyWindow(dummyHWND);
 }
 
 void ExecuteShader::InitializeDevice(IScriptEnvironment* env) {
 	render = new D3D9RenderImpl();
-	if (FAILED(render->Initialize(dummyHWND, m_ClipPrecision, m_Precision, m_OutputPrecision)))
-		env->ThrowError("ExecuteShader: Initialize failed.");
+	if (FAILED(render->Initialize(dummyHWND, m_ClipPrecision, m_Precision, m_OutputPrecision, m_Luma, m_HalfChroma)))
+		env->ThrowError(m_Luma || m_HalfChroma ? "ExecuteShader: Initialize failed. The graphics card may not support Luma or HalfChroma textures." : "ExecuteShader: Initialize failed.");
+
+	// Input clips reading the same clip with the same precision share their textures.
+	m_ClipSource.resize(m_clips.size());
+	for (size_t i = 0; i < m_clips.size(); i++) {
+		m_ClipSource[i] = (int)i;
+		for (size_t j = 0; j < i && m_clips[i] != NULL; j++) {
+			if (m_clips[j] == m_clips[i] && m_ClipPrecision[j] == m_ClipPrecision[i]) {
+				m_ClipSource[i] = (int)j;
+				break;
+			}
+		}
+	}
 
 	// We only need to know the difference between precision 2 and 3 to initialize video buffers. Then, both are 16 bits.
-	if (m_Precision == 3)
-		m_Precision = 2;
-	if (m_OutputPrecision == 3)
-		m_OutputPrecision = 2;
-	for (int i = 0; i < 9; i++) {
-		if (m_ClipPrecision[i] == 3)
-			m_ClipPrecision[i] = 2;
-	}
-
-	CreateInputClip(0, env);
-	CreateInputClip(1, env);
-	CreateInputClip(2, env);
-	CreateInputClip(3, env);
-	CreateInputClip(4, env);
-	CreateInputClip(5, env);
-	CreateInputClip(6, env);
-	CreateInputClip(7, env);
-	CreateInputClip(8, env);
+	// Precision 4 packs 10-bit channels into 4 bytes per pixel, like precision 1.
+	m_Precision = GetBytesPerChannel(m_Precision);
+	m_OutputPrecision = GetBytesPerChannel(m_OutputPrecision);
+	for (size_t i = 0; i < m_ClipPrecision.size(); i++) {
+		m_ClipPrecision[i] = GetBytesPerChannel(m_ClipPrecision[i]);
+	}
+
+	for (size_t i = 0; i < m_clips.size(); i++) {
+		CreateInputClip((int)i, env);
+	}
 
 	PVideoFrame src = child->GetFrame(0, env);
 	const byte* srcReader = src->GetReadPtr();
+	std::vector<CommandStruct> Commands(srcHeight);
+	for (int i = 0; i < srcHeight; i++) {
+		memcpy(&Commands[i], srcReader, sizeof(CommandStruct));
+		srcReader += src->GetPitch();
+	}
+	std::vector<CommandNode> Nodes = AnalyzeCommands(Commands, env);
+	render->AllocateCommands(srcHeight);
+	const int FirstOutput = (int)m_clips.size();
+
+	// Shaders are loaded before fusing commands, which links them. Luma textures keep a single channel of the output,
+	// which a fused shader would read in full.
+	for (int i = 0; i < srcHeight; i++) {
+		if (Nodes[i].Live && HasShader(&Commands[i]))
+			ConfigureShader(&Commands[i], env);
+	}
+	if (!m_Luma)
+		FuseCommands(Commands, Nodes);
+	SetLastUses(Nodes);
 
-	// Each row of input clip contains commands to execute. Create one texture for each command.
+	// Each row of input clip contains commands to execute. The chain is the same for every frame, so compile it
+	// once into a plan with resolved textures, sizes and constants. Create one texture for each command output,
+	// shared with other outputs of the same size whose lifetimes don't overlap.
 	CommandStruct cmd;
-	InputTexture* texture;
 	int OutputWidth, OutputHeight;
 	bool IsLast;
+	HRESULT hr;
 	render->ResetTextureClipIndex();
+	m_Plan.clear();
+	m_Plan.reserve(srcHeight);
 	for (int i = 0; i < srcHeight; i++) {
-		memcpy(&cmd, srcReader, sizeof(CommandStruct));
-		srcReader += src->GetPitch();
-		IsLast = i == srcHeight - 1; // Only create memory on the CPU side for the last command, as it is the only one that needs to be read back.
+		// Commands reading a removed command read the identical command instead, and fused commands run within the
+		// shader of the command reading them.
+		if (!Nodes[i].Live)
+			continue;
 
-		if (cmd.Path != NULL && cmd.Path[0] != '\0')
-			ConfigureShader(&cmd, env);
-		else {
-			if (cmd.ClipIndex[0] == cmd.OutputIndex)
+		cmd = Commands[i];
+		IsLast = i == srcHeight - 1; // Only create memory on the CPU side for the last command, as it is the only one that needs to be read back.
+		m_Plan.emplace_back();
+		CommandPlan* plan = &m_Plan.back();
+		plan->CommandIndex = cmd.CommandIndex;
+		plan->HasShader = HasShader(&cmd);
+		plan->IsLast = IsLast;
+		if (!plan->HasShader) {
+			if (GetClipIndex(&cmd, 0) == cmd.OutputIndex)
 				env->ThrowError("ExecuteShader: If Path is not specified, Output must be different than Clip1 to copy clip data");
 			if (cmd.OutputWidth != 0 || cmd.OutputHeight != 0)
 				env->ThrowError("ExecuteShader: If Path is not specified, OutputWidth and OutputHeight cannot be set");
+			if (GetReadTexture(Nodes[i].Reads[0], env)->ChromaTexture != NULL)
+				env->ThrowError("ExecuteShader: If Path is not specified, Clip1 cannot be a HalfChroma clip");
 		}
 
-		texture = render->FindTextureByClipIndex(cmd.OutputIndex, env);
-		// If clip at output position isn't defined, use dimensions of first clip by default.
-		if (texture->Texture == NULL)
-			texture = render->FindTextureByClipIndex(cmd.ClipIndex[0], env);
-		OutputWidth = cmd.OutputWidth > 0 ? cmd.OutputWidth : texture->Width;
-		OutputHeight = cmd.OutputHeight > 0 ? cmd.OutputHeight : texture->Height;
+		OutputWidth = Nodes[i].Width;
+		OutputHeight = Nodes[i].Height;
+		plan->OutputWidth = OutputWidth;
+		plan->OutputHeight = OutputHeight;
+
+		// Fused commands have the same output size, and their registers follow those of the commands before them.
+		ZeroMemory(plan->Samplers, sizeof(plan->Samplers));
+		for (const ShaderPass& pass : Nodes[i].Passes) {
+			const CommandStruct* PassCmd = &Commands[pass.Command];
+			BindClips(plan, PassCmd, Nodes, &pass, env);
+			if (plan->HasShader) {
+				// Param0 and Param1 default to the output size and its inverse.
+				for (int j = 0; j < max(PassCmd->ParamCount, 2); j++) {
+					if (j < PassCmd->ParamCount && PassCmd->Param[j].Type != ParamType::None)
+						AddConstant(plan, pass.ConstantOffset + j, &PassCmd->Param[j]);
+					else if (j == 0)
+						AddDefaultConstant(plan, pass.ConstantOffset + j, (float)OutputWidth, (float)OutputHeight);
+					else if (j == 1)
+						AddDefaultConstant(plan, pass.ConstantOffset + j, 1.0f / OutputWidth, 1.0f / OutputHeight);
+				}
+			}
+		}
 
-		if (FAILED(render->CreateInputTexture(9 + i, cmd.OutputIndex, OutputWidth, OutputHeight, IsLast, IsLast)))
+		if (IsLast && m_Batch > 1 && OutputHeight * m_Batch > render->GetMaxTextureHeight())
+			env->ThrowError("ExecuteShader: Batch is too large, Batch times the output height can't exceed %d", render->GetMaxTextureHeight());
+		if (IsLast) {
+			hr = render->CreateInputTexture(FirstOutput + i, cmd.OutputIndex, OutputWidth, OutputHeight, true, true);
+			if (SUCCEEDED(hr) && m_Batch > 1)
+				hr = render->CreateBatchTexture(FirstOutput + i, m_Batch);
+		}
+		else
+			hr = render->CreateSharedTexture(FirstOutput + i, cmd.OutputIndex, OutputWidth, OutputHeight, i, Nodes[i].LastUse);
+		if (FAILED(hr))
 			env->ThrowError("ExecuteShader: Failed to create input texture.");
+		plan->Output = &render->m_InputTextures[FirstOutput + i];
 
 		if (IsLast) {
 			if (cmd.OutputIndex != 1)
 				env->ThrowError("ExecuteShader: Last command must have Output = 1");
 
-			vi.width = OutputWidth * m_OutputPrecision;
+			// Luma output has 1 or 2 bytes per pixel in a RGB32 frame.
+			if (m_Luma && OutputWidth * m_OutputPrecision % 4)
+				env->ThrowError("ExecuteShader: Luma output width must be a multiple of 4 with OutputPrecision=1, or of 2 otherwise");
+			vi.width = m_Luma ? OutputWidth * m_OutputPrecision / 4 : OutputWidth * m_OutputPrecision;
 			vi.height = OutputHeight;
 		}
 	}
@@ -106,105 +172,370 @@ void ExecuteShader::InitializeDevice(IScriptEnvironment* env) {
 }
 
 PVideoFrame __stdcall ExecuteShader::GetFrame(int n, IScriptEnvironment* env) {
-	PVideoFrame src = child->GetFrame(n, env);
-	const byte* srcReader = src->GetReadPtr();
-
-	// Each row of input clip contains commands to execute
-	CommandStruct cmd;
-	bool IsLast;
-	InputTexture* texture;
-	int OutputWidth, OutputHeight;
-  
 	std::unique_lock<std::mutex> my_lock(executeshader_mutex);
 	// P.F. prevent parallel use of the class-global "render"
 	// Mutex will be unlocked when gets out of scope (exit from GetFrame() or {} block )
 
-	render->ResetTextureClipIndex();
-
-	// Copy input clips from AviSynth
-	for (int j = 0; j < 9; j++) {
-		CopyInputClip(j, n, env);
-	}
+	// Frames rendered by the previous batch are returned without running the commands again.
+	bool Sequential = n == m_LastRequest + 1;
+	m_LastRequest = n;
+	if (n >= m_CacheStart && n < m_CacheStart + (int)m_Cache.size())
+		return m_Cache[n - m_CacheStart];
+
+	// Run the commands on the following frames as one batch, read back at once. Batches only start when frames are
+	// requested in order, since instances created by Prefetch each receive frames that aren't adjacent.
+	int Count = Sequential ? max(1, min(m_Batch, vi.num_frames - n)) : 1;
+	if FAILED(render->BeginBatch(Count))
+		env->ThrowError("ExecuteShader: ProcessFrame failed.");
+	for (int k = 0; k < Count; k++) {
+		// Copy input clips from AviSynth
+		for (size_t j = 0; j < m_clips.size(); j++) {
+			CopyInputClip((int)j, n + k, env);
+		}
 
-	for (int i = 0; i < srcHeight; i++) {
-		memcpy(&cmd, srcReader, sizeof(CommandStruct));
-		srcReader += src->GetPitch();
-		IsLast = i == srcHeight - 1;
-
-		if (cmd.Path != NULL && cmd.Path[0] != '\0') {
-			// If clip at output position isn't defined, use dimensions of first clip by default.
-			texture = render->FindTextureByClipIndex(cmd.OutputIndex, env);
-			if (texture->Texture == NULL)
-				texture = render->FindTextureByClipIndex(cmd.ClipIndex[0], env);
-			OutputWidth = cmd.OutputWidth > 0 ? cmd.OutputWidth : texture->Width;
-			OutputHeight = cmd.OutputHeight > 0 ? cmd.OutputHeight : texture->Height;
-
-			// Set Param0 and Param1 default values.
-			SetDefaultParamValue(&cmd.Param[0], (float)OutputWidth, (float)OutputHeight, 0, 0);
-			SetDefaultParamValue(&cmd.Param[1], 1.0f / OutputWidth, 1.0f / OutputHeight, 0, 0);
-
-			// Configure pixel shader
-			for (int i = 0; i < 9; i++) {
-				if (cmd.Param[i].Type != ParamType::None) {
-					if (FAILED(render->SetPixelShaderConstant(i, &cmd.Param[i])))
+		// Run the commands compiled by InitializeDevice.
+		for (const CommandPlan& plan : m_Plan) {
+			if (plan.HasShader) {
+				// Configure pixel shader
+				for (const ShaderConstant& constant : plan.Constants) {
+					if (FAILED(render->SetPixelShaderConstant(&constant)))
 						env->ThrowError("ExecuteShader failed to set parameters.");
 				}
+
+				if FAILED(render->ProcessFrame(&plan, k, env))
+					env->ThrowError("ExecuteShader: ProcessFrame failed.");
+			}
+			else {
+				// Only copy Clip1 to Output without processing
+				if FAILED(render->CopyBuffer(plan.Source, plan.Output))
+					env->ThrowError("ExecuteShader: CopyBufferToBuffer failed.");
+			}
+		}
+	}
+	if FAILED(render->EndBatch())
+		env->ThrowError("ExecuteShader: ProcessFrame failed.");
+
+	// After last command, copy results back to AviSynth.
+	m_Cache.clear();
+	m_CacheStart = n;
+	for (int k = 0; k < Count; k++) {
+		PVideoFrame dst = env->NewVideoFrame(vi);
+		render->CopyBufferToAviSynth(srcHeight - 1, k, dst->GetWritePtr(), dst->GetPitch(), env);
+		m_Cache.push_back(dst);
+	}
+	return m_Cache[0];
+}
+
+// Resolves the clips read by each command and its output size. Commands repeating an earlier command are replaced
+// by its output, and commands whose output never reaches the last command are removed.
+// A clip index refers to the output of the latest previous command writing into it, or to an input clip.
+std::vector<CommandNode> ExecuteShader::AnalyzeCommands(const std::vector<CommandStruct>& commands, IScriptEnvironment* env) {
+	int Count = (int)commands.size();
+	std::vector<CommandNode> Nodes(Count);
+	std::unordered_map<int, int> Producer;
+	auto Resolve = [&](int clipIndex) {
+		auto Item = Producer.find(clipIndex);
+		return Item != Producer.end() ? Nodes[Item->second].Canonical : ~clipIndex;
+	};
+
+	for (int i = 0; i < Count; i++) {
+		const CommandStruct* cmd = &commands[i];
+		CommandNode* node = &Nodes[i];
+		// Commands without shader only read Clip1.
+		int ClipCount = HasShader(cmd) ? cmd->ClipCount : 1;
+		for (int j = 0; j < ClipCount; j++) {
+			node->Reads.push_back(Resolve(GetClipIndex(cmd, j)));
+		}
+
+		// If clip at output position isn't defined, use dimensions of first clip by default.
+		int Output = Resolve(cmd->OutputIndex);
+		InputTexture* Texture = Output < 0 ? render->FindTextureByClipIndex(~Output) : NULL;
+		if (Output < 0 && (Texture == NULL || Texture->Texture == NULL)) {
+			Output = Resolve(GetClipIndex(cmd, 0));
+			if (Output < 0)
+				Texture = render->FindTextureByClipIndex(~Output, env);
+		}
+		node->Width = cmd->OutputWidth > 0 ? cmd->OutputWidth : Output >= 0 ? Nodes[Output].Width : Texture->Width;
+		node->Height = cmd->OutputHeight > 0 ? cmd->OutputHeight : Output >= 0 ? Nodes[Output].Height : Texture->Height;
+
+		// The last command must write its own output to be read back.
+		node->Canonical = i;
+		for (int j = 0; j < i && i < Count - 1; j++) {
+			if (Nodes[j].Canonical == j && IsSameCommand(&commands[j], &Nodes[j], cmd, node)) {
+				node->Canonical = j;
+				break;
+			}
+		}
+		node->Live = false;
+		node->Passes.push_back({ i, 0, 0 });
+		Producer[cmd->OutputIndex] = i;
+	}
+
+	// Commands only read earlier commands, so a backward pass finds every command reached by the last one.
+	Nodes[Count - 1].Live = true;
+	for (int i = Count - 1; i >= 0; i--) {
+		if (Nodes[i].Live) {
+			for (int Read : Nodes[i].Reads) {
+				if (Read >= 0)
+					Nodes[Read].Live = true;
 			}
+		}
+	}
+	for (int i = 0; i < Count; i++) {
+		if (Nodes[i].Canonical != i)
+			DebugReport("ExecuteShader: Command %d removed, same as command %d", i, Nodes[i].Canonical);
+		else if (!Nodes[i].Live)
+			DebugReport("ExecuteShader: Command %d removed, its output is never read", i);
+	}
+	return Nodes;
+}
+
+// Returns whether two commands run the same shader with the same parameters on the same clips, at the same size.
+bool ExecuteShader::IsSameCommand(const CommandStruct* cmd1, const CommandNode* node1, const CommandStruct* cmd2, const CommandNode* node2) {
+	if (node1->Reads != node2->Reads || node1->Width != node2->Width || node1->Height != node2->Height)
+		return false;
+	auto IsSameString = [](const char* a, const char* b) {
+		return strcmp(a != NULL ? a : "", b != NULL ? b : "") == 0;
+	};
+	if (!IsSameString(cmd1->Path, cmd2->Path) || !IsSameString(cmd1->EntryPoint, cmd2->EntryPoint) || !IsSameString(cmd1->ShaderModel, cmd2->ShaderModel))
+		return false;
+	for (int i = 0; i < max(cmd1->ParamCount, cmd2->ParamCount); i++) {
+		if (!IsSameParam(cmd1, cmd2, i))
+			return false;
+	}
+	return true;
+}
 
-			if FAILED(render->ProcessFrame(&cmd, OutputWidth, OutputHeight, IsLast, env))
-				env->ThrowError("ExecuteShader: ProcessFrame failed.");
+// Returns whether two commands set a parameter to the same values. Bool parameters have Count values, others have Count Float4 vectors.
+bool ExecuteShader::IsSameParam(const CommandStruct* cmd1, const CommandStruct* cmd2, int index) {
+	const ParamStruct* Param1 = index < cmd1->ParamCount && cmd1->Param[index].Type != ParamType::None ? &cmd1->Param[index] : NULL;
+	const ParamStruct* Param2 = index < cmd2->ParamCount && cmd2->Param[index].Type != ParamType::None ? &cmd2->Param[index] : NULL;
+	if (Param1 == NULL || Param2 == NULL)
+		return Param1 == Param2;
+	if (Param1->Type != Param2->Type || Param1->Count != Param2->Count)
+		return false;
+	int ValueCount = Param1->Type == ParamType::Bool ? Param1->Count : Param1->Count * 4;
+	return memcmp(Param1->Values, Param2->Values, ValueCount * sizeof(float)) == 0;
+}
+
+// Fuses shader commands with the command producing one of their clips, when it is only read by them at the pixel
+// being rendered. The shader of the command then runs both shaders, reading that clip from a register instead of a
+// texture. A command is fused with at most one producer, which may itself have been fused with its own producer.
+// Skipping the texture between the shaders also skips its rounding.
+void ExecuteShader::FuseCommands(const std::vector<CommandStruct>& commands, std::vector<CommandNode>& nodes) {
+	int Count = (int)commands.size();
+	// Command reading each output, or -2 if read by several commands.
+	std::vector<int> Consumer(Count, -1);
+	for (int i = 0; i < Count; i++) {
+		if (nodes[i].Live) {
+			for (int Read : nodes[i].Reads) {
+				if (Read >= 0)
+					Consumer[Read] = Consumer[Read] == -1 || Consumer[Read] == i ? i : -2;
+			}
 		}
-		else {
-			// Only copy Clip1 to Output without processing
-			texture = render->FindTextureByClipIndex(cmd.ClipIndex[0], env);
-			if FAILED(render->CopyBuffer(texture, cmd.CommandIndex, cmd.OutputIndex, env))
-				env->ThrowError("ExecuteShader: CopyBufferToBuffer failed.");
+	}
+
+	for (int i = 0; i < Count; i++) {
+		CommandNode* Node = &nodes[i];
+		if (!Node->Live || !HasShader(&commands[i]) || GetFloatConstantCount(&commands[i]) < 0)
+			continue;
+		for (int Read : Node->Reads) {
+			if (Read < 0 || Consumer[Read] != i || !HasShader(&commands[Read]) || nodes[Read].Width != Node->Width || nodes[Read].Height != Node->Height)
+				continue;
+
+			CommandNode* Producer = &nodes[Read];
+			ShaderLinkInfo Info = {};
+			bool CanFuse = true;
+			for (const ShaderPass& pass : Producer->Passes) {
+				int Constants = GetFloatConstantCount(&commands[pass.Command]);
+				CanFuse = CanFuse && Constants >= 0;
+				Info.FirstConstants = max(Info.FirstConstants, pass.ConstantOffset + Constants);
+				Info.FirstSamplers = max(Info.FirstSamplers, pass.SamplerOffset + GetSamplerCount(&commands[pass.Command]));
+			}
+			Info.SecondConstants = GetFloatConstantCount(&commands[i]);
+			Info.SecondSamplers = GetSamplerCount(&commands[i]);
+			for (size_t j = 0; j < Node->Reads.size(); j++) {
+				if (Node->Reads[j] == Read)
+					Info.LinkedSamplers |= 1 << j;
+			}
+			if (!CanFuse || FAILED(render->LinkPixelShaders(commands[Read].CommandIndex, commands[i].CommandIndex, &Info)))
+				continue;
+
+			std::vector<ShaderPass> Passes = Producer->Passes;
+			Passes.push_back({ i, Info.ConstantOffset, Info.SamplerOffset });
+			Node->Passes = std::move(Passes);
+			Producer->Live = false;
+			DebugReport("ExecuteShader: Command %d fused into command %d", Read, i);
+			break;
 		}
 	}
+}
+
+// Returns the float registers set by the parameters of a command, including Param0 and Param1 set by default, or -1 if
+// it sets integer or bool registers, which can't be moved when fusing commands.
+int ExecuteShader::GetFloatConstantCount(const CommandStruct* cmd) {
+	int Result = 2;
+	for (int i = 0; i < cmd->ParamCount; i++) {
+		if (cmd->Param[i].Type == ParamType::Int || cmd->Param[i].Type == ParamType::Bool)
+			return -1;
+		if (cmd->Param[i].Type == ParamType::Float)
+			Result = max(Result, i + cmd->Param[i].Count);
+	}
+	return Result;
+}
 
-	// After last command, copy result back to AviSynth.
-	PVideoFrame dst = env->NewVideoFrame(vi);
-	render->CopyBufferToAviSynth(srcHeight - 1, dst->GetWritePtr(), dst->GetPitch(), env);
-	return dst;
+// Returns the samplers bound to clips of a command. The chroma of a HalfChroma clip takes the sampler after its clip.
+int ExecuteShader::GetSamplerCount(const CommandStruct* cmd) {
+	return min(cmd->ClipCount + (m_HalfChroma ? 1 : 0), MaxSamplers);
 }
 
-// Sets the default parameter value if it is not already defined.
-void ExecuteShader::SetDefaultParamValue(ParamStruct* p, float value0, float value1, float value2, float value3) {
-	if (p->Type == ParamType::None) {
-		p->Type = ParamType::Float;
-		p->Count = 1;
-		p->Values = new float[4];
-		p->Values[0] = value0;
-		p->Values[1] = value1;
-		p->Values[2] = value2;
-		p->Values[3] = value3;
+// Finds the last command reading each output once commands are fused. Fused commands read their inputs when the
+// command running their shader is executed.
+void ExecuteShader::SetLastUses(std::vector<CommandNode>& nodes) {
+	for (size_t i = 0; i < nodes.size(); i++) {
+		nodes[i].LastUse = (int)i;
+	}
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodes[i].Live) {
+			for (const ShaderPass& pass : nodes[i].Passes) {
+				for (int Read : nodes[pass.Command].Reads) {
+					if (Read >= 0 && nodes[Read].Live)
+						nodes[Read].LastUse = (int)i;
+				}
+			}
+		}
 	}
 }
 
+// Returns the texture of a clip read by a command: the output of an earlier command, or an input clip.
+InputTexture* ExecuteShader::GetReadTexture(int read, IScriptEnvironment* env) {
+	return read >= 0 ? &render->m_InputTextures[m_clips.size() + read] : render->FindTextureByClipIndex(~read, env);
+}
+
+// Resolves the textures bound to each sampler of a command, and the source texture of a copy command. Samplers of
+// fused commands are moved by the offset of their pass, and clips produced by the commands fused before them aren't bound.
+void ExecuteShader::BindClips(CommandPlan* plan, const CommandStruct* cmd, const std::vector<CommandNode>& nodes, const ShaderPass* pass, IScriptEnvironment* env) {
+	const std::vector<int>& Reads = nodes[pass->Command].Reads;
+	InputTexture* Input;
+	if (!plan->HasShader) {
+		plan->Source = GetReadTexture(Reads[0], env);
+		return;
+	}
+
+	for (int i = 0; i < cmd->ClipCount; i++) {
+		int Sampler = pass->SamplerOffset + i;
+		if (cmd->ClipIndex[i] > 0 && (Reads[i] < 0 || nodes[Reads[i]].Live)) {
+			Input = GetReadTexture(Reads[i], env);
+			plan->Samplers[Sampler] = { Input, false };
+			// Chroma of a HalfChroma clip takes the next sampler.
+			if (Input->ChromaTexture != NULL) {
+				if (Sampler == MaxSamplers - 1 || GetClipIndex(cmd, i + 1) > 0)
+					env->ThrowError("ExecuteShader: The clip following a HalfChroma clip must not be set, its sampler receives the chroma");
+				plan->Samplers[Sampler + 1] = { Input, true };
+			}
+		}
+	}
+}
+
+// Copies a shader parameter into the plan. Bool parameters have Count values, others have Count Float4 vectors.
+void ExecuteShader::AddConstant(CommandPlan* plan, int index, const ParamStruct* param) {
+	ShaderConstant Constant;
+	Constant.Register = index;
+	Constant.Type = param->Type;
+	Constant.Count = param->Count;
+	Constant.Values.assign(param->Values, param->Values + (param->Type == ParamType::Bool ? param->Count : param->Count * 4));
+	plan->Constants.push_back(std::move(Constant));
+}
+
+// Adds a Float4 constant for a parameter that isn't defined.
+void ExecuteShader::AddDefaultConstant(CommandPlan* plan, int index, float value0, float value1) {
+	ShaderConstant Constant;
+	Constant.Register = index;
+	Constant.Type = ParamType::Float;
+	Constant.Count = 1;
+	Constant.Values = { value0, value1, 0, 0 };
+	plan->Constants.push_back(std::move(Constant));
+}
+
 void ExecuteShader::CreateInputClip(int index, IScriptEnvironment* env) {
-	// clip1-clip9 take texture spots 0-8. Then, each shader execution will output in subsequent texture spots.
+	// Input clips take the first texture spots. Then, each shader execution will output in subsequent texture spots.
 	PClip clip = m_clips[index];
-	if (clip != NULL) {
+	if (m_ClipSource[index] != index) {
+		render->ShareInputTexture(index, m_ClipSource[index]);
+		render->m_InputTextures[index].ClipIndex = index + 1;
+	}
+	else if (clip != NULL) {
 		if (!clip->GetVideoInfo().IsRGB32())
 			env->ThrowError("ExecuteShader: You must first call ConvertToShader on source");
 
-		if (FAILED(render->CreateInputTexture(index, index + 1, clip->GetVideoInfo().width / m_ClipPrecision[index], clip->GetVideoInfo().height, true, false)))
+		if (m_HalfChroma) {
+			if (clip->GetVideoInfo().height % 3 || GetTextureHeight(clip->GetVideoInfo().height) & 1 || GetTextureWidth(clip->GetVideoInfo().width, m_ClipPrecision[index]) & 1)
+				env->ThrowError("ExecuteShader: HalfChroma clips must be converted with ConvertToShader(HalfChroma=true)");
+			if (FAILED(render->CreateHalfChromaTexture(index, index + 1, GetTextureWidth(clip->GetVideoInfo().width, m_ClipPrecision[index]), GetTextureHeight(clip->GetVideoInfo().height))))
+				env->ThrowError("ExecuteShader: Failed to create input textures.");
+		}
+		else if (FAILED(render->CreateInputTexture(index, index + 1, GetTextureWidth(clip->GetVideoInfo().width, m_ClipPrecision[index]), clip->GetVideoInfo().height, true, false)))
 			env->ThrowError("ExecuteShader: Failed to create input textures.");
 	}
 	else
 		render->m_InputTextures[index].ClipIndex = index + 1;
 }
 
-// Copies the first clip from AviSynth before running the first command.
+// Copies an input clip from AviSynth before running the first command. Frames still held by the textures of the clip
+// and clips sharing the textures of an earlier clip aren't copied again.
 void ExecuteShader::CopyInputClip(int index, int n, IScriptEnvironment* env) {
 	PClip clip = m_clips[index];
-	if (m_clips[index] != NULL) {
+	bool Cached;
+	if (m_ClipSource[index] != index) {
+		render->ShareInputTexture(index, m_ClipSource[index]);
+		m_UploadsShared++;
+	}
+	else if (m_clips[index] != NULL) {
+		if (FAILED(render->SelectUpload(index, n, Cached)))
+			env->ThrowError("ExecuteShader: CopyInputClip failed");
+		if (Cached) {
+			m_UploadHits++;
+			return;
+		}
 		PVideoFrame frame = clip->GetFrame(n, env);
-		if (FAILED(render->CopyAviSynthToBuffer(frame->GetReadPtr(), frame->GetPitch(), index, clip->GetVideoInfo().width / m_ClipPrecision[index], clip->GetVideoInfo().height, env)))
+		if (FAILED(render->CopyAviSynthToBuffer(frame->GetReadPtr(), frame->GetPitch(), index, GetTextureWidth(clip->GetVideoInfo().width, m_ClipPrecision[index]), GetTextureHeight(clip->GetVideoInfo().height), env)))
 			env->ThrowError("ExecuteShader: CopyInputClip failed");
+		render->CompleteUpload(index, n);
+		m_UploadMisses++;
 	}
 }
 
+// Writes a line of statistics with OutputDebugString, visible with DebugView. The buffer fits the whole message.
+void ExecuteShader::DebugReport(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int Length = _vscprintf(format, args);
+	va_end(args);
+	if (Length < 0)
+		return;
+
+	std::vector<char> Buffer(Length + 1);
+	va_start(args, format);
+	vsprintf_s(Buffer.data(), Buffer.size(), format, args);
+	va_end(args);
+	OutputDebugString(Buffer.data());
+}
+
+// Returns the size of each channel in the AviSynth frame: 1 for BYTE and packed 10-bit textures, 2 for UINT16 and half-float.
+int ExecuteShader::GetBytesPerChannel(int precision) {
+	return precision == 2 || precision == 3 ? 2 : 1;
+}
+
+// Returns the texture width of a clip. Texture pixels take 4 or 8 bytes, or 1 or 2 bytes with Luma and HalfChroma, in a RGB32 frame.
+int ExecuteShader::GetTextureWidth(int clipWidth, int precision) {
+	return m_Luma || m_HalfChroma ? clipWidth * 4 / precision : clipWidth / precision;
+}
+
+// Returns the texture height of a clip. HalfChroma clips have rows of chroma below the luma rows.
+int ExecuteShader::GetTextureHeight(int clipHeight) {
+	return m_HalfChroma ? clipHeight / 3 * 2 : clipHeight;
+}
+
 void ExecuteShader::ConfigureShader(CommandStruct* cmd, IScriptEnvironment* env) {
 	if FAILED(render->InitPixelShader(cmd, env)) {
 		char* ErrorText = "Shader: Failed to open pixel shader ";
@@ -3,27 +3,74 @@
 #include <d3d9.h>
 #include <d3dx9.h>
 #include <cstdio>		//needed by OutputDebugString()
+#include <cstdarg>
 #include "avisynth.h"
 #include "D3D9RenderImpl.h"
 #include <mutex>
+#include <vector>
+#include <unordered_map>
+
+// A command whose shader runs within the shader of a later command, with its registers moved after those of the
+// commands before it.
+struct ShaderPass {
+	int Command;
+	int ConstantOffset;
+	int SamplerOffset;
+};
+
+// Dependencies of a command in the chain, resolved before creating any texture.
+struct CommandNode {
+	std::vector<int> Reads;	// Command producing each sampler, or ~ClipIndex for input clips and unused samplers.
+	int Width, Height;
+	int Canonical;			// Earlier identical command whose output is used instead, or the command itself.
+	bool Live;				// Whether the output is read by the last command, directly or not. Fused commands aren't live.
+	int LastUse;			// Last live command reading the output.
+	std::vector<ShaderPass> Passes;	// Commands run by the shader of this command, ending with itself.
+};
 
 class ExecuteShader : public GenericVideoFilter {
 public:
-	ExecuteShader(PClip _child, PClip _clip1, PClip _clip2, PClip _clip3, PClip _clip4, PClip _clip5, PClip _clip6, PClip _clip7, PClip _clip8, PClip _clip9, int _clipPrecision[9], int _precision, int _outputPrecision, IScriptEnvironment* env);
+	ExecuteShader(PClip _child, const std::vector<PClip>& _clips, const std::vector<int>& _clipPrecision, int _precision, int _outputPrecision, bool _luma, bool _halfChroma, int _batch, IScriptEnvironment* env);
 	~ExecuteShader();
 	PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 private:
 	void InitializeDevice(IScriptEnvironment* env);
 	void CreateInputClip(int index, IScriptEnvironment* env);
 	void CopyInputClip(int index, int n, IScriptEnvironment* env);
+	int GetBytesPerChannel(int precision);
+	int GetTextureWidth(int clipWidth, int precision);
+	int GetTextureHeight(int clipHeight);
 	void ConfigureShader(CommandStruct* cmd, IScriptEnvironment* env);
-	void ExecuteShader::SetDefaultParamValue(ParamStruct* p, float value0, float value1, float value2, float value3);
+	std::vector<CommandNode> AnalyzeCommands(const std::vector<CommandStruct>& commands, IScriptEnvironment* env);
+	bool IsSameCommand(const CommandStruct* cmd1, const CommandNode* node1, const CommandStruct* cmd2, const CommandNode* node2);
+	bool IsSameParam(const CommandStruct* cmd1, const CommandStruct* cmd2, int index);
+	void FuseCommands(const std::vector<CommandStruct>& commands, std::vector<CommandNode>& nodes);
+	int GetFloatConstantCount(const CommandStruct* cmd);
+	int GetSamplerCount(const CommandStruct* cmd);
+	void SetLastUses(std::vector<CommandNode>& nodes);
+	InputTexture* GetReadTexture(int read, IScriptEnvironment* env);
+	void BindClips(CommandPlan* plan, const CommandStruct* cmd, const std::vector<CommandNode>& nodes, const ShaderPass* pass, IScriptEnvironment* env);
+	void AddConstant(CommandPlan* plan, int index, const ParamStruct* param);
+	void AddDefaultConstant(CommandPlan* plan, int index, float value0, float value1);
+	static void DebugReport(const char* format, ...);
 	int m_Precision;
 	int m_OutputPrecision;
-	PClip m_clips[9];
-	int m_ClipPrecision[9];
+	bool m_Luma;
+	bool m_HalfChroma;
+	int m_Batch;
+	std::vector<PClip> m_clips;
+	std::vector<int> m_ClipPrecision;
+	std::vector<int> m_ClipSource;	// Earlier input clip reading the same clip, or the clip itself.
+	__int64 m_UploadHits = 0;		// Frames found in the upload ring of their clip.
+	__int64 m_UploadMisses = 0;
+	__int64 m_UploadsShared = 0;	// Frames of clips sharing the textures of an earlier clip, not counted as hits.
 	HWND dummyHWND;
 	D3D9RenderImpl* render;
 	int srcHeight;
+	std::vector<CommandPlan> m_Plan;
+	// Output frames of the last batch, starting with frame m_CacheStart.
+	std::vector<PVideoFrame> m_Cache;
+	int m_CacheStart = 0;
+	int m_LastRequest = -2;	// Last frame requested, to only batch frames requested in order.
 	std::mutex executeshader_mutex;
 };
\ No newline at end of file
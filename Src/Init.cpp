@@ -8,66 +8,52 @@
 const int DefaultConvertYuv = false;
 
 AVSValue __cdecl Create_ConvertToShader(AVSValue args, void* user_data, IScriptEnvironment* env) {
-	PClip input = args[0].AsClip();
-	if (input->GetVideoInfo().IsYV12()) {
-		if (args[2].AsBool(false)) // Stack16
-			input = env->Invoke("Eval", AVSValue("Dither_resize16(Width(),Height()/2, csp=\"YV24\")")).AsClip();
-		else
-			input = env->Invoke("ConvertToYV24", input).AsClip();
-	}
-
 	return new ConvertToShader(
-		input,					// source clip
-		args[1].AsInt(2),		// precision, 1 for RGB32, 2 for UINT16 and 3 for half-float data.
-		args[2].AsBool(false),	// lsb / Stack16
-		env);					// env is the link to essential informations, always provide it
+		args[0].AsClip(),			// source clip
+		args[1].AsInt(2),			// precision, 1 for RGB32, 2 for UINT16 and 3 for half-float data.
+		args[2].AsBool(false),		// lsb / Stack16
+		args[3].AsString("MPEG2"),	// chroma placement of YV12 source
+		args[4].AsInt(1),			// threads, 0 to use all cores
+		args[5].AsInt(-1),			// opt, -1 to detect the instruction set, 0 to 4 to force a lower level
+		args[6].AsString(""),		// semi-planar source format stored in a Y8 or Y16 clip, NV12, P010 or P016
+		args[7].AsBool(false),		// luma, to convert only the luma plane into single-channel textures
+		args[8].AsBool(false),		// halfChroma, to keep 4:2:0 chroma at half resolution below the luma rows
+		args[9].IsClip() ? args[9].AsClip() : nullptr,	// alpha, a clip whose first plane is packed into the alpha channel
+		env);						// env is the link to essential informations, always provide it
 }
 
 AVSValue __cdecl Create_ConvertFromShader(AVSValue args, void* user_data, IScriptEnvironment* env) {
-	ConvertFromShader* Result = new ConvertFromShader(
+	return new ConvertFromShader(
 		args[0].AsClip(),			// source clip
 		args[1].AsInt(2),			// precision, 1 for RGB32, 2 for UINT16 and 3 for half-float data.
-		args[2].AsString("YV12"),	// destination format
+		args[2].AsString(args[8].AsBool(false) ? "Y8" : "YV12"),	// destination format
 		args[3].AsBool(false),		// lsb / Stack16
+		args[4].AsString("MPEG2"),	// chroma placement of YV12 destination
+		args[5].AsInt(0),			// dither, 0 to round, 1 for ordered dithering, 2 for error diffusion
+		args[6].AsInt(1),			// threads, 0 to use all cores
+		args[7].AsInt(-1),			// opt, -1 to detect the instruction set, 0 to 4 to force a lower level
+		args[8].AsBool(false),		// luma, to convert single-channel textures into Y8 or Y16
 		env);						// env is the link to essential informations, always provide it
-
-	if (strcmp(args[2].AsString("YV12"), "YV12") == 0) {
-		if (args[3].AsBool(false)) {// Stack16
-			AVSValue sargs[4] = { Result, Result->GetVideoInfo().width, Result->GetVideoInfo().height / 2, "YV12" };
-			const char *nargs[4] = { 0, 0, 0, "csp" };
-			return env->Invoke("Dither_resize16", AVSValue(sargs, 4), nargs).AsClip();
-		}
-		else
-			return env->Invoke("ConvertToYV12", Result).AsClip();
-	}
-	else
-		return Result;
 }
 
 AVSValue __cdecl Create_Shader(AVSValue args, void* user_data, IScriptEnvironment* env) {
+	// Param0-Param8 are 4-12, Clip1-Clip9 are 13-21, Clip10-Clip16 are 25-31 and Param9-Param15 are 32-38.
+	std::vector<const char*> Params;
+	for (int i = 0; i < 16; i++) {
+		Params.push_back(args[i < 9 ? i + 4 : i + 23].AsString(""));
+	}
+	std::vector<int> Clips;
+	for (int i = 0; i < MaxSamplers; i++) {
+		Clips.push_back(args[i < 9 ? i + 13 : i + 16].AsInt(i == 0 ? 1 : 0));
+	}
+
 	return new Shader(
 		args[0].AsClip(),			// source clip
 		args[1].AsString(""),		// shader path
 		args[2].AsString("main"),	// entry point
 		args[3].AsString(""),		// shader model
-		args[4].AsString(""),		// param 0
-		args[5].AsString(""),		// param 1
-		args[6].AsString(""),		// param 2
-		args[7].AsString(""),		// param 3
-		args[8].AsString(""),		// param 4
-		args[9].AsString(""),		// param 5
-		args[10].AsString(""),		// param 6
-		args[11].AsString(""),		// param 7
-		args[12].AsString(""),		// param 8
-		args[13].AsInt(1),			// clip 1
-		args[14].AsInt(0),			// clip 2
-		args[15].AsInt(0),			// clip 3
-		args[16].AsInt(0),			// clip 4
-		args[17].AsInt(0),			// clip 5
-		args[18].AsInt(0),			// clip 6
-		args[19].AsInt(0),			// clip 7
-		args[20].AsInt(0),			// clip 8
-		args[21].AsInt(0),			// clip 9
+		Params,						// param 0-15
+		Clips,						// clip 1-16
 		args[22].AsInt(1),			// output clip
 		args[23].AsInt(0),			// width
 		args[24].AsInt(0),			// height
@@ -75,29 +61,29 @@ AVSValue __cdecl Create_Shader(AVSValue args, void* user_data, IScriptEnvironmen
 }
 
 AVSValue __cdecl Create_ExecuteShader(AVSValue args, void* user_data, IScriptEnvironment* env) {
-	int ParamClipPrecision[9];
+	// P.F. IsClip() pre-check, because avisynth debug version give assert if AsClip() is not a clip
+	// preventing happy debugging
+	// Clip1-Clip9 are 1-9, Clip1Precision-Clip9Precision are 10-18, Clip10-Clip16 are 24-30 and
+	// Clip10Precision-Clip16Precision are 31-37.
+	std::vector<PClip> Clips;
+	std::vector<int> ClipPrecision;
 	int CurrentPrecision = 2;
-	for (int i = 0; i < 9; i++) {
-		CurrentPrecision = args[i + 10].AsInt(CurrentPrecision);
-		ParamClipPrecision[i] = CurrentPrecision;
+	for (int i = 0; i < MaxSamplers; i++) {
+		const AVSValue& Clip = args[i < 9 ? i + 1 : i + 15];
+		Clips.push_back(Clip.IsClip() ? Clip.AsClip() : nullptr);
+		CurrentPrecision = args[i < 9 ? i + 10 : i + 22].AsInt(CurrentPrecision);
+		ClipPrecision.push_back(CurrentPrecision);
 	}
 
-	// P.F. IsClip() pre-check, because avisynth debug version give assert if AsClip() is not a clip
-	// preventing happy debugging
 	return new ExecuteShader(
 		args[0].AsClip(),			// source clip containing commands
-		args[1].IsClip() ? args[1].AsClip() : nullptr,			// Clip1
-		args[2].IsClip() ? args[2].AsClip() : nullptr,			// Clip2
-		args[3].IsClip() ? args[3].AsClip() : nullptr,			// Clip3
-		args[4].IsClip() ? args[4].AsClip() : nullptr,			// Clip4
-		args[5].IsClip() ? args[5].AsClip() : nullptr,			// Clip5
-		args[6].IsClip() ? args[6].AsClip() : nullptr,			// Clip6
-		args[7].IsClip() ? args[7].AsClip() : nullptr,			// Clip7
-		args[8].IsClip() ? args[8].AsClip() : nullptr,			// Clip8
-		args[9].IsClip() ? args[9].AsClip() : nullptr,			// Clip9
-		ParamClipPrecision,			// ClipPrecision, 10-18
+		Clips,						// Clip1-Clip16
+		ClipPrecision,				// Clip1Precision-Clip16Precision
 		args[19].AsInt(2),			// precision
 		args[20].AsInt(2),			// precisionOut
+		args[21].AsBool(false),		// luma, to use single-channel textures
+		args[22].AsBool(false),		// halfChroma, to upload input clips as luma and half-resolution chroma textures
+		args[23].AsInt(1),			// batch, the number of frames processed and read back at once
 		env);
 }
 
@@ -105,10 +91,10 @@ const AVS_Linkage *AVS_linkage = 0;
 
 extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScriptEnvironment* env, const AVS_Linkage* const vectors) {
 	AVS_linkage = vectors;
-	env->AddFunction("ConvertToShader", "c[Precision]i[lsb]b", Create_ConvertToShader, 0);
-	env->AddFunction("ConvertFromShader", "c[Precision]i[Format]s[lsb]b", Create_ConvertFromShader, 0);
-	env->AddFunction("Shader", "c[Path]s[EntryPoint]s[ShaderModel]s[Param0]s[Param1]s[Param2]s[Param3]s[Param4]s[Param5]s[Param6]s[Param7]s[Param8]s[Clip1]i[Clip2]i[Clip3]i[Clip4]i[Clip5]i[Clip6]i[Clip7]i[Clip8]i[Clip9]i[Output]i[Width]i[Height]i", Create_Shader, 0);
-	env->AddFunction("ExecuteShader", "c[Clip1]c[Clip2]c[Clip3]c[Clip4]c[Clip5]c[Clip6]c[Clip7]c[Clip8]c[Clip9]c[Clip1Precision]i[Clip2Precision]i[Clip3Precision]i[Clip4Precision]i[Clip5Precision]i[Clip6Precision]i[Clip7Precision]i[Clip8Precision]i[Clip9Precision]i[Precision]i[OutputPrecision]i", Create_ExecuteShader, 0);
+	env->AddFunction("ConvertToShader", "c[Precision]i[lsb]b[ChromaInPlacement]s[Threads]i[Opt]i[Format]s[Luma]b[HalfChroma]b[Alpha]c", Create_ConvertToShader, 0);
+	env->AddFunction("ConvertFromShader", "c[Precision]i[Format]s[lsb]b[ChromaOutPlacement]s[Dither]i[Threads]i[Opt]i[Luma]b", Create_ConvertFromShader, 0);
+	env->AddFunction("Shader", "c[Path]s[EntryPoint]s[ShaderModel]s[Param0]s[Param1]s[Param2]s[Param3]s[Param4]s[Param5]s[Param6]s[Param7]s[Param8]s[Clip1]i[Clip2]i[Clip3]i[Clip4]i[Clip5]i[Clip6]i[Clip7]i[Clip8]i[Clip9]i[Output]i[Width]i[Height]i[Clip10]i[Clip11]i[Clip12]i[Clip13]i[Clip14]i[Clip15]i[Clip16]i[Param9]s[Param10]s[Param11]s[Param12]s[Param13]s[Param14]s[Param15]s", Create_Shader, 0);
+	env->AddFunction("ExecuteShader", "c[Clip1]c[Clip2]c[Clip3]c[Clip4]c[Clip5]c[Clip6]c[Clip7]c[Clip8]c[Clip9]c[Clip1Precision]i[Clip2Precision]i[Clip3Precision]i[Clip4Precision]i[Clip5Precision]i[Clip6Precision]i[Clip7Precision]i[Clip8Precision]i[Clip9Precision]i[Precision]i[OutputPrecision]i[Luma]b[HalfChroma]b[Batch]i[Clip10]c[Clip11]c[Clip12]c[Clip13]c[Clip14]c[Clip15]c[Clip16]c[Clip10Precision]i[Clip11Precision]i[Clip12Precision]i[Clip13Precision]i[Clip14Precision]i[Clip15Precision]i[Clip16Precision]i", Create_ExecuteShader, 0);
 
 	if (env->FunctionExists("SetFilterMTMode")) {
 		auto env2 = static_cast<IScriptEnvironment2*>(env);
@@ -2,33 +2,29 @@
 // http://gamedev.stackexchange.com/questions/13435/loading-and-using-an-hlsl-shader
 
 Shader::Shader(PClip _child, const char* _path, const char* _entryPoint, const char* _shaderModel,
-	const char* _param0, const char* _param1, const char* _param2, const char* _param3, const char* _param4, const char* _param5, const char* _param6, const char* _param7, const char* _param8,
-	int _clip1, int _clip2, int _clip3, int _clip4, int _clip5, int _clip6, int _clip7, int _clip8, int _clip9, int _output, int _width, int _height, IScriptEnvironment* env) :
-	GenericVideoFilter(_child), path(_path), entryPoint(_entryPoint), shaderModel(_shaderModel),
-	param1(_param0), param2(_param1), param3(_param2), param4(_param3), param5(_param4), param6(_param5), param7(_param6), param8(_param7), param9(_param8) {
+	const std::vector<const char*>& _params, const std::vector<int>& _clips, int _output, int _width, int _height, IScriptEnvironment* env) :
+	GenericVideoFilter(_child), path(_path), entryPoint(_entryPoint), shaderModel(_shaderModel), clips(_clips) {
+
+	// Trailing unused clips and parameters don't need to be stored.
+	while (!clips.empty() && clips.back() == 0)
+		clips.pop_back();
+	size_t ParamCount = _params.size();
+	while (ParamCount > 0 && (_params[ParamCount - 1] == NULL || _params[ParamCount - 1][0] == '\0'))
+		ParamCount--;
+	params.resize(ParamCount);
+	for (size_t i = 0; i < ParamCount; i++) {
+		ZeroMemory(&params[i], sizeof(ParamStruct));
+		params[i].String = _params[i];
+	}
 
 	ZeroMemory(&cmd, sizeof(CommandStruct));
 	cmd.Path = _path;
 	cmd.EntryPoint = _entryPoint;
 	cmd.ShaderModel = _shaderModel;
-	cmd.Param[0].String = _param0;
-	cmd.Param[1].String = _param1;
-	cmd.Param[2].String = _param2;
-	cmd.Param[3].String = _param3;
-	cmd.Param[4].String = _param4;
-	cmd.Param[5].String = _param5;
-	cmd.Param[6].String = _param6;
-	cmd.Param[7].String = _param7;
-	cmd.Param[8].String = _param8;
-	cmd.ClipIndex[0] = _clip1;
-	cmd.ClipIndex[1] = _clip2;
-	cmd.ClipIndex[2] = _clip3;
-	cmd.ClipIndex[3] = _clip4;
-	cmd.ClipIndex[4] = _clip5;
-	cmd.ClipIndex[5] = _clip6;
-	cmd.ClipIndex[6] = _clip7;
-	cmd.ClipIndex[7] = _clip8;
-	cmd.ClipIndex[8] = _clip9;
+	cmd.ParamCount = (int)params.size();
+	cmd.Param = params.data();
+	cmd.ClipCount = (int)clips.size();
+	cmd.ClipIndex = clips.data();
 	cmd.OutputIndex = _output;
 	cmd.OutputWidth = _width;
 	cmd.OutputHeight = _height;
@@ -36,6 +32,14 @@ Shader::Shader(PClip _child, const char* _path, const char* _entryPoint, const c
 	// Validate parameters
 	//if (path == NULL || path[0] == '\0')
 	//	env->ThrowError("Shader: path to a compiled shader must be specified");
+	if (cmd.ClipCount > MaxSamplers)
+		env->ThrowError("Shader: A shader can read from at most 16 clips");
+	for (int i = 0; i < cmd.ClipCount; i++) {
+		if (clips[i] < 0)
+			env->ThrowError("Shader: Clip indexes must be positive");
+	}
+	if (_output < 1)
+		env->ThrowError("Shader: Output must be 1 or more");
 
 	if (vi.pixel_type != VideoInfo::CS_Y8) {
 		vi.pixel_type = VideoInfo::CS_Y8;
@@ -49,7 +53,7 @@ Shader::Shader(PClip _child, const char* _path, const char* _entryPoint, const c
 
 	// Configure pixel shader
 	if (path != NULL && path[0] != '\0') {
-		for (int i = 0; i < 9; i++) {
+		for (int i = 0; i < cmd.ParamCount; i++) {
 			ParamStruct* param = &cmd.Param[i];
 			if (param->String && param->String[0] != '\0') {
 				if (!ParseParam(param)) {
@@ -57,19 +61,24 @@ Shader::Shader(PClip _child, const char* _path, const char* _entryPoint, const c
 					char* FullText;
 					int FullTextLength = strlen(ErrorText) - 3 + strlen(param->String) + 1;
 					FullText = (char*)malloc(FullTextLength);
-					sprintf_s(FullText, FullTextLength, ErrorText, i + 1, param->String);
+					sprintf_s(FullText, FullTextLength, ErrorText, i, param->String);
 					env->ThrowError(FullText);
 					free(FullText);
 				}
+				// ps_3_0 has 224 float registers, and 16 int and bool registers.
+				if (param->Type == ParamType::Float && i + param->Count > 224)
+					env->ThrowError("Shader: Float parameters must fit within registers c0 to c223");
+				if (param->Type != ParamType::Float && i + param->Count > 16)
+					env->ThrowError("Shader: Int and bool parameters must fit within registers 0 to 15");
 			}
 		}
 	}
 }
 
 Shader::~Shader() {
-	for (int i = 0; i < 9; i++) {
+	for (int i = 0; i < cmd.ParamCount; i++) {
 		if (cmd.Param[i].Count > 0)
-			delete cmd.Param[i].Values;
+			delete[] cmd.Param[i].Values;
 	}
 }
 
@@ -105,14 +114,14 @@ bool Shader::ParseParam(ParamStruct* param) {
 		return false;
 
 	if (Type == 'b') {
-		// Assign float array and store bool in it.
+		// Assign float array and store BOOL in it.
 		param->Count = StrVal.size();
-		param->Values = new float[param->Count];
+		param->Values = new float[param->Count]();
 	}
 	else {
-		// Assign blocks of Float4 vectors
+		// Assign blocks of Float4 vectors. Unset elements are 0, so that identical parameters compare equal.
 		param->Count = (StrVal.size() + 3) / 4;
-		param->Values = new float[param->Count * 4];
+		param->Values = new float[param->Count * 4]();
 	}
 
 	// Convert all values
@@ -125,8 +134,8 @@ bool Shader::ParseParam(ParamStruct* param) {
 				param->Values[i] = *(float*)&IntVal; // Store int data in float vector
 			}
 			else if (Type == 'b') {
-				bool BoolVal = StrVal[i] == "0" ? false : true;
-				param->Values[i] = *(float*)&BoolVal; // Store bool data in float vector (even if bool size may be smaller than float)
+				BOOL BoolVal = StrVal[i] == "0" ? FALSE : TRUE;
+				param->Values[i] = *(float*)&BoolVal; // Store BOOL data in float vector, both are 32 bits
 			}
 		}
 	}
@@ -0,0 +1,241 @@
+#include "ShaderLinker.h"
+// Shader model 3 tokens are described in the Direct3D 9 driver documentation.
+// https://msdn.microsoft.com/en-us/library/windows/hardware/ff552891(v=vs.85).aspx
+
+static const DWORD VersionPS30 = 0xFFFF0300;
+static const DWORD EndToken = 0x0000FFFF;
+static const DWORD OpcodeMask = 0x0000FFFF;
+static const DWORD CommentOpcode = 0xFFFE;
+static const DWORD ControlsMask = 0x00FF0000;
+static const DWORD RelativeAddressing = 0x00002000;
+static const DWORD WriteMask = 0x000F0000;
+static const DWORD SwizzleMask = 0x00FF0000;
+static const DWORD NoSwizzle = 0x00E40000;
+static const DWORD SourceModifierMask = 0x0F000000;
+static const DWORD SaturateModifier = 0x00100000;
+static const DWORD ParamBit = 0x80000000;
+
+enum ShaderOpcode { OpMov = 1, OpRet = 28, OpDcl = 31, OpDefB = 47, OpDefI = 48, OpTexKill = 65, OpTexLd = 66, OpDef = 81 };
+enum ShaderRegister { RegTemp = 0, RegInput = 1, RegConst = 2, RegColorOut = 8, RegSampler = 10, RegMisc = 17 };
+static const int MaxTemps = 32;
+static const int MaxConstants = 224;
+static const int MaxSamplerCount = 16;
+static const int TexcoordUsage = 5;
+
+struct ShaderInstruction {
+	DWORD Token;
+	std::vector<DWORD> Params;
+};
+
+// Registers used by a shader.
+struct ShaderUsage {
+	int Temps = 0;
+	int Constants = 0;
+	int Samplers = 0;
+	int TexcoordInput = -1;	// Input register declared as TEXCOORD0.
+	DWORD ColorMask = 0;		// Components written into oC0.
+};
+
+static int GetOpcode(const ShaderInstruction& ins) {
+	return ins.Token & OpcodeMask;
+}
+
+static int GetRegisterType(DWORD param) {
+	return ((param >> 28) & 7) | ((param >> 8) & 0x18);
+}
+
+static int GetRegisterNumber(DWORD param) {
+	return param & 0x7FF;
+}
+
+static DWORD SetRegister(DWORD param, int type, int number) {
+	return (param & ~(DWORD)0x70001FFF) | ((type & 7) << 28) | ((type & 0x18) << 8) | number;
+}
+
+static bool IsDeclaration(const ShaderInstruction& ins) {
+	int Op = GetOpcode(ins);
+	return Op == OpDcl || Op == OpDef || Op == OpDefI || Op == OpDefB;
+}
+
+// Returns whether a parameter is a register, rather than the usage of a declaration or a literal value.
+static bool IsRegister(const ShaderInstruction& ins, size_t index) {
+	int Op = GetOpcode(ins);
+	if (Op == OpDcl)
+		return index == 1;
+	if (Op == OpDef || Op == OpDefI || Op == OpDefB)
+		return index == 0;
+	return true;
+}
+
+// Splits shader code into instructions, leaving out comments such as the constant table.
+static bool ParseShader(const std::vector<DWORD>& code, std::vector<ShaderInstruction>& output) {
+	if (code.empty() || code[0] != VersionPS30)
+		return false;
+	size_t i = 1;
+	while (i < code.size()) {
+		DWORD Token = code[i];
+		if (Token == EndToken)
+			return true;
+		bool IsComment = (Token & OpcodeMask) == CommentOpcode;
+		size_t Length = IsComment ? (Token >> 16) & 0x7FFF : (Token >> 24) & 0xF;
+		if (i + 1 + Length > code.size())
+			return false;
+		if (!IsComment) {
+			ShaderInstruction Item;
+			Item.Token = Token;
+			Item.Params.assign(code.begin() + i + 1, code.begin() + i + 1 + Length);
+			int Op = GetOpcode(Item);
+			if ((Op == OpDcl && Length != 2) || (Op == OpTexLd && Length != 3) || ((Op == OpDef || Op == OpDefI) && Length != 5) || (Op == OpDefB && Length != 2))
+				return false;
+			output.push_back(Item);
+		}
+		i += 1 + Length;
+	}
+	return false;
+}
+
+// Finds the registers used by a shader. Integer and bool constants, loops, predicates, depth output, subroutines and
+// relative addressing aren't supported.
+static bool GetUsage(const std::vector<ShaderInstruction>& shader, ShaderUsage& usage) {
+	for (const ShaderInstruction& ins : shader) {
+		for (size_t j = 0; j < ins.Params.size(); j++) {
+			if (!IsRegister(ins, j))
+				continue;
+			DWORD Param = ins.Params[j];
+			int Number = GetRegisterNumber(Param);
+			if (Param & RelativeAddressing)
+				return false;
+			switch (GetRegisterType(Param)) {
+			case RegTemp:
+				usage.Temps = max(usage.Temps, Number + 1);
+				break;
+			case RegConst:
+				usage.Constants = max(usage.Constants, Number + 1);
+				break;
+			case RegSampler:
+				if (Number >= MaxSamplerCount)
+					return false;
+				usage.Samplers = max(usage.Samplers, Number + 1);
+				break;
+			case RegColorOut:
+				if (Number != 0)
+					return false;
+				usage.ColorMask |= Param & WriteMask;
+				break;
+			case RegInput:
+			case RegMisc:
+				break;
+			default:
+				return false;
+			}
+		}
+		if (GetOpcode(ins) == OpDcl && GetRegisterType(ins.Params[1]) == RegInput && (ins.Params[0] & 0x000F000F) == TexcoordUsage)
+			usage.TexcoordInput = GetRegisterNumber(ins.Params[1]);
+	}
+	return true;
+}
+
+bool LinkPixelShaders(const std::vector<DWORD>& first, const std::vector<DWORD>& second, ShaderLinkInfo* info, std::vector<DWORD>& linked) {
+	std::vector<ShaderInstruction> First, Second;
+	ShaderUsage FirstUsage, SecondUsage;
+	if (!ParseShader(first, First) || !ParseShader(second, Second) || !GetUsage(First, FirstUsage) || !GetUsage(Second, SecondUsage))
+		return false;
+	if (FirstUsage.ColorMask != WriteMask || SecondUsage.TexcoordInput < 0)
+		return false;
+
+	// The output of the first shader takes the temporary register following its own, and registers of the second
+	// shader follow those of the first.
+	const int Output = FirstUsage.Temps;
+	const int TempOffset = Output + 1;
+	info->ConstantOffset = max(FirstUsage.Constants, info->FirstConstants);
+	info->SamplerOffset = max(FirstUsage.Samplers, info->FirstSamplers);
+	if (TempOffset + SecondUsage.Temps > MaxTemps ||
+		info->ConstantOffset + max(SecondUsage.Constants, info->SecondConstants) > MaxConstants ||
+		info->SamplerOffset + max(SecondUsage.Samplers, info->SecondSamplers) > MaxSamplerCount)
+		return false;
+
+	std::vector<ShaderInstruction> Declarations, Body;
+	for (const ShaderInstruction& ins : First) {
+		// A pixel discarded by the first shader would keep the previous content of its texture, and returning would skip
+		// the second shader.
+		if (GetOpcode(ins) == OpTexKill || GetOpcode(ins) == OpRet)
+			return false;
+		ShaderInstruction Item = ins;
+		for (size_t j = 0; j < Item.Params.size(); j++) {
+			if (IsRegister(ins, j) && GetRegisterType(ins.Params[j]) == RegColorOut)
+				Item.Params[j] = SetRegister(ins.Params[j], RegTemp, Output);
+		}
+		(IsDeclaration(ins) ? Declarations : Body).push_back(Item);
+	}
+
+	for (const ShaderInstruction& ins : Second) {
+		int Op = GetOpcode(ins);
+		if (Op == OpDcl) {
+			int Type = GetRegisterType(ins.Params[1]);
+			int Number = GetRegisterNumber(ins.Params[1]);
+			// Inputs are interpolated the same way for both shaders, so their declarations are merged.
+			if (Type == RegInput || Type == RegMisc) {
+				ShaderInstruction* Existing = NULL;
+				for (ShaderInstruction& Item : Declarations) {
+					if (GetOpcode(Item) == OpDcl && GetRegisterType(Item.Params[1]) == Type && GetRegisterNumber(Item.Params[1]) == Number)
+						Existing = &Item;
+				}
+				if (Existing == NULL)
+					Declarations.push_back(ins);
+				else if (Existing->Params[0] != ins.Params[0] || (Existing->Params[1] & ~WriteMask) != (ins.Params[1] & ~WriteMask))
+					return false;
+				else
+					Existing->Params[1] |= ins.Params[1] & WriteMask;
+				continue;
+			}
+			if (Type == RegSampler && (info->LinkedSamplers & (1 << Number)))
+				continue;
+		}
+
+		// Sampling the output of the first shader at the interpolated coordinate becomes a move from its register.
+		ShaderInstruction Item = ins;
+		bool IsLinkedRead = Op == OpTexLd && GetRegisterType(ins.Params[2]) == RegSampler && (info->LinkedSamplers & (1 << GetRegisterNumber(ins.Params[2])));
+		if (IsLinkedRead) {
+			DWORD Coord = ins.Params[1];
+			if ((ins.Token & ControlsMask) || GetRegisterType(Coord) != RegInput || GetRegisterNumber(Coord) != SecondUsage.TexcoordInput ||
+				(Coord & (SwizzleMask | SourceModifierMask)) != NoSwizzle || (ins.Params[2] & SourceModifierMask))
+				return false;
+			Item.Token = OpMov | (2 << 24);
+			Item.Params.resize(1);
+		}
+		for (size_t j = 0; j < Item.Params.size(); j++) {
+			if (!IsRegister(Item, j))
+				continue;
+			DWORD Param = Item.Params[j];
+			int Number = GetRegisterNumber(Param);
+			int Type = GetRegisterType(Param);
+			if (Type == RegTemp)
+				Item.Params[j] = SetRegister(Param, RegTemp, Number + TempOffset);
+			else if (Type == RegConst)
+				Item.Params[j] = SetRegister(Param, RegConst, Number + info->ConstantOffset);
+			else if (Type == RegSampler) {
+				// Linked samplers can only be read at the interpolated coordinate.
+				if (info->LinkedSamplers & (1 << Number))
+					return false;
+				Item.Params[j] = SetRegister(Param, RegSampler, Number + info->SamplerOffset);
+			}
+		}
+		if (IsLinkedRead) {
+			if (info->Saturate)
+				Item.Params[0] |= SaturateModifier;
+			Item.Params.push_back(SetRegister(ParamBit | (ins.Params[2] & SwizzleMask), RegTemp, Output));
+		}
+		(IsDeclaration(ins) ? Declarations : Body).push_back(Item);
+	}
+
+	linked.clear();
+	linked.push_back(VersionPS30);
+	for (const std::vector<ShaderInstruction>* List : { &Declarations, &Body }) {
+		for (const ShaderInstruction& ins : *List) {
+			linked.push_back(ins.Token);
+			linked.insert(linked.end(), ins.Params.begin(), ins.Params.end());
+		}
+	}
+	linked.push_back(EndToken);
+	return true;
+}
\ No newline at end of file
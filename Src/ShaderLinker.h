@@ -0,0 +1,20 @@
+#pragma once
+#include <windows.h>
+#include <vector>
+
+// How the second of two linked shaders reads the output of the first, and where its registers are moved.
+struct ShaderLinkInfo {
+	int FirstConstants;			// Float registers set by the parameters of each shader.
+	int SecondConstants;
+	int FirstSamplers;			// Samplers bound to clips of each shader.
+	int SecondSamplers;
+	unsigned int LinkedSamplers;	// Samplers of the second shader reading the output of the first.
+	bool Saturate;				// Whether the output of the first shader is clamped by the format of its texture.
+	int ConstantOffset;			// Set on success, added to the constant and sampler registers of the second shader.
+	int SamplerOffset;
+};
+
+// Links two ps_3_0 shaders into one running the first shader and then the second, when the second only reads the
+// output of the first at the pixel being rendered. The output of the first shader is kept in a temporary register
+// instead of a texture. Returns false if either shader uses features that can't be linked.
+bool LinkPixelShaders(const std::vector<DWORD>& first, const std::vector<DWORD>& second, ShaderLinkInfo* info, std::vector<DWORD>& linked);
\ No newline at end of file
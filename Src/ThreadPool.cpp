@@ -0,0 +1,70 @@
+#include "ThreadPool.h"
+
+ThreadPool& ThreadPool::GetInstance() {
+	// Never destroyed: joining threads while the DLL unloads would deadlock, the process cleans them up on exit.
+	static ThreadPool* instance = new ThreadPool();
+	return *instance;
+}
+
+ThreadPool::ThreadPool() {
+	int count = (int)std::thread::hardware_concurrency() - 1;
+	for (int i = 0; i < max(count, 1); i++) {
+		workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+	}
+}
+
+void ThreadPool::WorkerLoop() {
+	std::unique_lock<std::mutex> lock(jobsMutex);
+	while (true) {
+		jobsAvailable.wait(lock, [this] { return !jobs.empty(); });
+		RunPendingJob(lock);
+	}
+}
+
+// Runs the next queued job without holding the lock. Returns false if the queue is empty.
+bool ThreadPool::RunPendingJob(std::unique_lock<std::mutex>& lock) {
+	if (jobs.empty())
+		return false;
+	std::function<void()> job = std::move(jobs.front());
+	jobs.pop_front();
+	lock.unlock();
+	job();
+	lock.lock();
+	return true;
+}
+
+void ThreadPool::Run(int threadCount, int height, int rowAlign, const std::function<void(int, int)>& func) {
+	if (threadCount <= 0)
+		threadCount = (int)workers.size() + 1;
+	// Each stripe should have at least a few rows to be worth the synchronization.
+	const int stripeCount = min(threadCount, max(height / max(rowAlign, 16), 1));
+	if (stripeCount <= 1) {
+		func(0, height);
+		return;
+	}
+
+	const int stripeHeight = (height / stripeCount + rowAlign - 1) / rowAlign * rowAlign;
+	int remaining = stripeCount - 1;
+	std::unique_lock<std::mutex> lock(jobsMutex);
+	for (int i = 1; i < stripeCount; i++) {
+		const int yStart = min(i * stripeHeight, height);
+		const int yEnd = i == stripeCount - 1 ? height : min(yStart + stripeHeight, height);
+		jobs.push_back([this, &func, &remaining, yStart, yEnd] {
+			func(yStart, yEnd);
+			std::lock_guard<std::mutex> doneLock(jobsMutex);
+			if (--remaining == 0)
+				jobsDone.notify_all();
+		});
+	}
+	jobsAvailable.notify_all();
+	lock.unlock();
+
+	func(0, min(stripeHeight, height));
+
+	// Help with queued jobs while waiting, so that concurrent frames can't starve each other of workers.
+	lock.lock();
+	while (remaining > 0) {
+		if (!RunPendingJob(lock))
+			jobsDone.wait(lock);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+#include <windows.h>
+#include <malloc.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+// Shared pool of worker threads used by the converters to process stripes of rows in parallel.
+class ThreadPool {
+public:
+	static ThreadPool& GetInstance();
+	// Splits rows 0 to height into stripes of a multiple of rowAlign rows and runs func(yStart, yEnd) for each stripe
+	// on up to threadCount threads, including the calling thread. 0 uses all cores. Returns once all stripes are done.
+	void Run(int threadCount, int height, int rowAlign, const std::function<void(int, int)>& func);
+private:
+	ThreadPool();
+	void WorkerLoop();
+	bool RunPendingJob(std::unique_lock<std::mutex>& lock);
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex jobsMutex;
+	std::condition_variable jobsAvailable;
+	std::condition_variable jobsDone;
+};
+
+// Grow-only aligned memory block. Declared thread_local by the converters so that each thread keeps
+// its own scratch rows from one frame to the next instead of allocating them on every frame.
+class ScratchBuffer {
+public:
+	ScratchBuffer() : buffer(NULL), size(0) {}
+	~ScratchBuffer() { _aligned_free(buffer); }
+	template <typename T>
+	T* Get(size_t count) {
+		if (count * sizeof(T) > size) {
+			_aligned_free(buffer);
+			size = count * sizeof(T);
+			buffer = _aligned_malloc(size, 64);
+		}
+		return static_cast<T*>(buffer);
+	}
+private:
+	void* buffer;
+	size_t size;
+};
\ No newline at end of file
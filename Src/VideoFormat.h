@@ -0,0 +1,15 @@
+#pragma once
+#include "avisynth.h"
+
+// Returns the number of bits per sample of a clip, 32 being float. AviSynth 2.6 formats are all 8-bit.
+inline int GetBitsPerComponent(const VideoInfo& vi)
+{
+	switch (vi.pixel_type & VideoInfo::CS_Sample_Bits_Mask) {
+	case VideoInfo::CS_Sample_Bits_10: return 10;
+	case VideoInfo::CS_Sample_Bits_12: return 12;
+	case VideoInfo::CS_Sample_Bits_14: return 14;
+	case VideoInfo::CS_Sample_Bits_16: return 16;
+	case VideoInfo::CS_Sample_Bits_32: return 32;
+	default: return 8;
+	}
+}
\ No newline at end of file
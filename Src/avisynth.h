@@ -404,6 +404,39 @@ Planar filter mask 1111.1111.1111.1111.1111.1111.1100.1111
     CS_RGB48 = CS_PLANAR | CS_RGB | CS_Sample_Bits_16,                                                     // Planar RGB 16bit samples
     CS_RGB96 = CS_PLANAR | CS_RGB | CS_Sample_Bits_32,                                                     // Planar RGB 32bit samples
 */
+
+    //AVS+ high bit depth formats
+    CS_Sample_Bits_10 = 5 << CS_Shift_Sample_Bits,
+    CS_Sample_Bits_12 = 6 << CS_Shift_Sample_Bits,
+    CS_Sample_Bits_14 = 7 << CS_Shift_Sample_Bits,
+
+    CS_RGB_TYPE  = 1 << 0,
+    CS_RGBA_TYPE = 1 << 1,
+
+    CS_GENERIC_YUV420 = CS_PLANAR | CS_YUV | CS_VPlaneFirst | CS_Sub_Height_2 | CS_Sub_Width_2,  // 4:2:0 planar
+    CS_GENERIC_YUV444 = CS_PLANAR | CS_YUV | CS_VPlaneFirst | CS_Sub_Height_1 | CS_Sub_Width_1,  // 4:4:4 planar
+    CS_GENERIC_RGBP   = CS_PLANAR | CS_BGR | CS_RGB_TYPE,                                         // planar RGB
+
+    CS_YUV420P10 = CS_GENERIC_YUV420 | CS_Sample_Bits_10,
+    CS_YUV420P12 = CS_GENERIC_YUV420 | CS_Sample_Bits_12,
+    CS_YUV420P14 = CS_GENERIC_YUV420 | CS_Sample_Bits_14,
+    CS_YUV420P16 = CS_GENERIC_YUV420 | CS_Sample_Bits_16,
+    CS_YUV420PS  = CS_GENERIC_YUV420 | CS_Sample_Bits_32,
+
+    CS_YUV444P10 = CS_GENERIC_YUV444 | CS_Sample_Bits_10,
+    CS_YUV444P12 = CS_GENERIC_YUV444 | CS_Sample_Bits_12,
+    CS_YUV444P14 = CS_GENERIC_YUV444 | CS_Sample_Bits_14,
+    CS_YUV444P16 = CS_GENERIC_YUV444 | CS_Sample_Bits_16,
+    CS_YUV444PS  = CS_GENERIC_YUV444 | CS_Sample_Bits_32,
+
+    CS_RGBP10 = CS_GENERIC_RGBP | CS_Sample_Bits_10,
+    CS_RGBP12 = CS_GENERIC_RGBP | CS_Sample_Bits_12,
+    CS_RGBP14 = CS_GENERIC_RGBP | CS_Sample_Bits_14,
+    CS_RGBP16 = CS_GENERIC_RGBP | CS_Sample_Bits_16,
+    CS_RGBPS  = CS_GENERIC_RGBP | CS_Sample_Bits_32,
+
+    CS_GENERIC_Y = CS_PLANAR | CS_INTERLEAVED | CS_YUV,                                           // Y only
+    CS_Y16       = CS_GENERIC_Y | CS_Sample_Bits_16,
   };
 
   int pixel_type;                // changed to int as of 2.5